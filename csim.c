@@ -3,310 +3,6650 @@
  * and evictions.
  *
  * Solves Cache Lab Part A from https://csapp.cs.cmu.edu/3e/labs.html.
+ *
+ * Build with -pthread -lm. With -DCSIM_LIBRARY there is no main, nor any of
+ * the trace readers, tools, or options of the command line, and the simulator
+ * is used through the API of csim.h instead. Everything else is static.
  */
 
+#define _GNU_SOURCE
+
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef CSIM_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CSIM_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#if (defined(__AVX2__) || defined(__AVX512F__)) && !defined(CSIM_NO_SIMD)
+#include <immintrin.h>
+#elif defined(__SSE2__) && !defined(CSIM_NO_SIMD)
+#include <emmintrin.h>
+#endif
+
+#include "csim.h"
+
 // #include "cachelab.h"
 
 /*
- * A CacheLine is a node in a doubly linked list. A CacheLine contains a tag
- * which uniquely identifies it within its CacheSet.
+ * A CacheLine is a node in a doubly linked list. A CacheLine contains a tag
+ * which uniquely identifies it within its CacheSet.
+ */
+typedef struct CacheLine {
+    uint64_t tag;
+    struct CacheLine *prev;
+    struct CacheLine *next;
+} CacheLine;
+
+/*
+ * A CacheSet contains pointers to the least recently used (lru) and most
+ * recently used (mru) CacheLine. The lru and mru are the tail and head,
+ * respectively, of a doubly linked list which represents all CacheLines
+ * currently in the CacheSet. The doubly linked list is always kept in a sorted
+ * order, with the less recently used CacheLines towards the tail.
+ *
+ * A CacheSet keeps track of its size in order to determine when it has become
+ * full.
+ */
+typedef struct CacheSet {
+    int size;
+    CacheLine *lru;
+    CacheLine *mru;
+} CacheSet;
+
+/*
+ * A StackNode is one block in a set's LRU stack under the stack engine. The
+ * nodes of a set form a treap ordered by the time of their last access, with
+ * a random heap priority and the size of each subtree, so that the number of
+ * blocks accessed more recently than a given one (its stack distance) is an
+ * O(log N) walk. Children are positions within the set's nodes plus one, with
+ * zero meaning none.
+ */
+typedef struct StackNode {
+    uint64_t tag;
+    uint64_t time;
+    uint32_t left;
+    uint32_t right;
+    uint32_t size;
+    uint32_t priority;
+} StackNode;
+
+/*
+ * The list engine keeps each CacheSet as the linked list above. The hash
+ * engine keeps the same list plus a per-set tag index, see hash_index. The soa
+ * engine keeps each set as a row of tags plus a row of LRU ages instead; see
+ * soa_tags. The stack engine keeps each set as a treap of StackNodes and
+ * records stack distances, which give the counters of every smaller
+ * associativity as well; see stack_distance_count. ENGINE_AUTO picks list or
+ * hash from lines_per_set.
+ */
+typedef enum Engine {
+    ENGINE_AUTO,
+    ENGINE_LIST,
+    ENGINE_HASH,
+    ENGINE_SOA,
+    ENGINE_STACK,
+} Engine;
+
+/*
+ * The replacement policy of a Cache. Every engine implements POLICY_LRU; the
+ * others run only on the soa layout, with soa_age holding each way's policy
+ * state instead of its LRU age (see policy_access), and ENGINE_AUTO picks soa
+ * for them.
+ */
+typedef enum Policy {
+    POLICY_LRU,
+    POLICY_FIFO,
+    POLICY_RANDOM,
+    POLICY_PLRU,
+    POLICY_NRU,
+    POLICY_SRRIP,
+    POLICY_BRRIP,
+    POLICY_LFU,
+    POLICY_COUNT,
+} Policy;
+
+/*
+ * The coherence protocol between the private caches of --cores, if any.
+ */
+typedef enum Protocol {
+    PROTOCOL_NONE,
+    PROTOCOL_MESI,
+    PROTOCOL_MOESI,
+} Protocol;
+
+/*
+ * A set of hit, miss, and eviction counters, for the groups and breakdowns
+ * that are counted besides those of a whole Cache.
+ */
+typedef struct Counters {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} Counters;
+
+/*
+ * A BlockSet is a growable open-addressing set of block numbers, each stored
+ * plus one so that zero means empty. It is kept at most half full.
+ */
+typedef struct BlockSet {
+    uint64_t *slots;
+    uint64_t capacity;
+    uint64_t count;
+} BlockSet;
+
+#define COHERENCE_INVALID 0
+#define COHERENCE_SHARED 1
+#define COHERENCE_EXCLUSIVE 2
+#define COHERENCE_OWNED 3
+#define COHERENCE_MODIFIED 4
+
+#define MAX_CORES 64
+
+#define WRITE_BACK 1
+#define WRITE_THROUGH 2
+#define WRITE_NO_ALLOCATE 4
+
+#define PREFETCH_NEXT_LINE 1
+#define PREFETCH_STRIDE 2
+#define PREFETCH_STREAM 4
+
+#define PREFETCH_PAGE_BITS 12
+#define STRIDE_TABLE_SIZE 256
+#define STRIDE_DEGREE 2
+#define STREAM_COUNT 16
+#define STREAM_DEPTH 4
+
+typedef struct StrideEntry {
+    uint64_t region;
+    uint64_t last_block;
+    int64_t stride;
+    int confidence;
+} StrideEntry;
+
+typedef struct Stream {
+    uint64_t next;
+    uint64_t end;
+    uint64_t used;
+} Stream;
+
+/*
+ * The state of the hardware prefetchers of a cache (--prefetcher). The
+ * stride prefetcher tracks one StrideEntry per 4 KB region, in a direct-mapped
+ * table: the last block accessed there, the distance from the one before,
+ * and how many times in a row that distance repeated. The stream prefetcher
+ * follows up to STREAM_COUNT ascending streams, each waiting for an access to
+ * a block from next to end + 1, where end is the last block it prefetched.
+ *
+ * fills counts the blocks the prefetchers brought in, hits the demand
+ * accesses that found a prefetched block before any other access did,
+ * useless the prefetched blocks evicted before any access, and evictions the
+ * blocks that prefetches evicted.
+ */
+typedef struct Prefetcher {
+    StrideEntry strides[STRIDE_TABLE_SIZE];
+    Stream streams[STREAM_COUNT];
+    uint64_t clock;
+    uint64_t fills;
+    uint64_t hits;
+    uint64_t useless;
+    uint64_t evictions;
+} Prefetcher;
+
+/*
+ * A Cache is one simulated cache: its geometry, the storage for its sets under
+ * the chosen engine, and its counters. Only the storage of its own engine is
+ * allocated. Any number of Caches can be fed from the same trace; see --sweep.
+ */
+typedef struct Cache {
+    int set_bit_count;
+    int lines_per_set;
+    int offset_bit_count;
+    uint64_t set_count;
+    Engine engine;
+    Policy policy;
+
+    /*
+     * A cache is an array of set_count CacheSets.
+     */
+    CacheSet *sets;
+
+    /*
+     * Every CacheLine lives in a single arena of set_count * lines_per_set
+     * lines. The lines_per_set lines starting at line_arena + i * lines_per_set
+     * belong to sets[i]; a set hands them out in order while it fills up and
+     * afterwards reuses whichever line it evicts.
+     */
+    CacheLine *line_arena;
+
+    /*
+     * The hash engine gives set i an open-addressing table of hash_capacity
+     * slots starting at hash_index + i * hash_capacity, mapping a tag to the
+     * position of its CacheLine within the set's arena lines. A slot holds that
+     * position plus one, so zero means empty. The table is linear-probed, at
+     * most half full, and deletions shift later entries back instead of leaving
+     * tombstones, so both a hit and a miss cost O(1) expected.
+     */
+    uint32_t *hash_index;
+    uint64_t hash_capacity;
+    int hash_shift;
+
+    /*
+     * The soa engine stores set i as soa_stride tags starting at
+     * soa_tags + i * soa_stride, 64-byte aligned so that a set of up to 8 lines
+     * is one host cache line and a lookup is one vector compare per 8
+     * (AVX-512) or 4 (AVX2) lines. Only the first soa_size[i] ways hold valid
+     * lines.
+     *
+     * soa_age holds the LRU order as one byte per way: 0 is the most recently
+     * used line, and the valid ways of a set always hold a permutation of
+     * 0 .. soa_size[i]-1. Ways past lines_per_set are padding and never match.
+     *
+     * A way invalidated by a cache hierarchy (see level_invalidate) keeps its
+     * place among the valid ways but holds SOA_HOLE, and soa_holes is set so
+     * that a full set refills holes before evicting anything.
+     */
+    uint64_t soa_stride;
+    uint64_t *soa_tags;
+    uint8_t *soa_age;
+    uint8_t *soa_size;
+    int soa_holes;
+
+    /*
+     * Policies other than LRU keep one word of state per set in
+     * policy_state[i]: the tree bits under PLRU, the next victim under FIFO,
+     * and the random number generator of the set under RANDOM and BRRIP (see
+     * policy_random), so that its draws do not depend on the -j split.
+     */
+    uint64_t *policy_state;
+
+    /*
+     * The stack engine gives set i the lines_per_set StackNodes starting at
+     * stack_nodes + i * lines_per_set, rooted at stack_root[i], and finds them
+     * by tag through the same hash_index tables as the hash engine. A set's
+     * stack is cut off at lines_per_set blocks: anything deeper misses at every
+     * associativity being measured.
+     *
+     * LRU has the inclusion property, so an access at stack distance d hits in
+     * every cache of more than d lines per set. stack_distance_count[d] counts
+     * the hits at distance d, and stack_fill_count[n] counts the misses that
+     * found n blocks on their set's stack; a miss evicts in every cache of at
+     * most n lines per set. See stack_counters.
+     */
+    StackNode *stack_nodes;
+    uint32_t *stack_root;
+    uint64_t stack_clock;
+    uint64_t stack_seed;
+    uint64_t *stack_distance_count;
+    uint64_t *stack_fill_count;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    /*
+     * In an inclusive hierarchy, the lines this cache dropped because a lower
+     * level evicted them.
+     */
+    uint64_t invalidations;
+
+    /*
+     * The list engine adds the number of lines each find() looks at to
+     * find_probes, for --stats.
+     */
+    uint64_t find_probes;
+
+    /*
+     * With --dedup (LRU only), last_tag[i] is the complement of the tag of
+     * the last block accessed in set i, or zero (that of NO_TAG), so that the
+     * array starts out all zeros. That block is the set's most recently used
+     * line, so another access to it is a hit that changes nothing, and
+     * simulate_access counts it without going to the engine. dedup_hits counts
+     * the hits taken that way, for --stats.
+     */
+    uint64_t *last_tag;
+    uint64_t dedup_hits;
+    int dedup;
+
+    /*
+     * The batch loops prefetch the state of the set that the record
+     * prefetch_distance records ahead maps to, if the cache has at least
+     * PREFETCH_MIN_SETS sets; see prefetch_set. 0 turns this off.
+     */
+    int prefetch_distance;
+
+    /*
+     * With --sample-sets, only one set in sample_period is simulated: those
+     * whose sample key (the set index, or a hash of it if sample_hashed) is a
+     * multiple of sample_period. sample_group[i] is 0 for a set that is not
+     * sampled and one plus its group otherwise. The sampled sets are dealt
+     * round-robin into SAMPLE_GROUPS groups, each counting its own accesses,
+     * and the spread between groups gives the confidence intervals; see
+     * sample_estimate.
+     */
+    uint64_t sample_period;
+    int sample_hashed;
+    uint64_t sampled_set_count;
+    uint8_t *sample_group;
+    Counters *sample_groups;
+
+    /*
+     * --breakdown adds the counters of each operation (op_counters, by
+     * BREAKDOWN_OP_INDEX) and of each set (set_counters[i]), and sorts the
+     * misses into cold, capacity, and conflict ones. A cold miss is the first
+     * access to its block; of the others, a miss that the fully associative
+     * LRU cache of the same capacity in shadow also takes is a capacity miss
+     * and the rest are conflict misses. seen holds every block accessed so far.
+     *
+     * op_counters lives in the Cache itself so that every -j worker counts into
+     * its own, and a worker only touches the set_counters of its own sets.
+     */
+    int breakdown;
+    Counters op_counters[3];
+    Counters *set_counters;
+    uint64_t cold_misses;
+    uint64_t capacity_misses;
+    uint64_t conflict_misses;
+    struct Cache *shadow;
+    BlockSet *seen;
+
+    /*
+     * prefetchers holds the PREFETCH_ flags of --prefetcher. The prefetchers
+     * fill the cache through the same soa paths as a hierarchy (see
+     * level_access), and bit j of prefetched[i] is set while way j of set i
+     * holds a prefetched block that no access has used yet.
+     */
+    int prefetchers;
+    Prefetcher *prefetcher;
+    uint64_t *prefetched;
+
+    /*
+     * write_mode holds the WRITE_ flags of --write, or 0 if stores are plain
+     * accesses. Writes are modeled on the soa engine: bit j of dirty[i] is set
+     * while way j of set i holds a block written since it was filled. The
+     * traffic counters are the bytes read from and written to the level below,
+     * which is memory.
+     */
+    int write_mode;
+    uint64_t *dirty;
+    uint64_t dirty_evictions;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+
+    /*
+     * Under a Protocol, each core of --cores has its own cache, and
+     * coherence[i * soa_stride + j] is the COHERENCE_ state of way j of set i.
+     * A way invalidated by another core's store becomes a SOA_HOLE and keeps
+     * the tag it lost in lost_tags, so that a miss on that tag before the way
+     * is refilled counts as a coherence miss.
+     *
+     * invalidations counts the lines other cores' stores invalidated,
+     * interventions the misses of other cores this cache supplied dirty data
+     * to, upgrades the stores that hit a shared or owned line and had to
+     * invalidate the other copies, and writebacks the dirty lines written to
+     * memory, evicted or (under MESI) demoted to shared.
+     */
+    Protocol protocol;
+    uint8_t *coherence;
+    uint64_t *lost_tags;
+    uint64_t coherence_misses;
+    uint64_t interventions;
+    uint64_t upgrades;
+    uint64_t writebacks;
+} Cache;
+
+#define SAMPLE_GROUPS 64
+
+/*
+ * A cache of fewer sets than PREFETCH_MIN_SETS likely fits in the host's own
+ * caches, and prefetching its sets is pure overhead.
+ */
+#define PREFETCH_DISTANCE 8
+#define PREFETCH_MIN_SETS (1 << 14)
+
+/*
+ * No tag has all its bits set, as the offset bits (at least one) are shifted
+ * out of it.
+ */
+#define NO_TAG UINT64_MAX
+
+/*
+ * The arrays of a cache that have an entry per set or way are allocated with
+ * sparse_calloc: from SPARSE_MIN_BYTES on, as an anonymous mapping that the
+ * kernel fills with zero pages on first touch and does not reserve swap for.
+ * A cache of billions of sets then starts at once, and takes memory only for
+ * the pages of the sets the trace touches. Each block starts with a header
+ * of SPARSE_HEADER_BYTES holding its length, which keeps it 64-byte aligned.
+ */
+#define SPARSE_MIN_BYTES ((size_t) 1 << 21)
+#define SPARSE_HEADER_BYTES 64
+
+#define BREAKDOWN_OPS 1
+#define BREAKDOWN_SETS 2
+#define BREAKDOWN_MISSES 4
+
+#define BREAKDOWN_OP_INDEX(operation) ((operation) == 'L' ? 0 : (operation) == 'S' ? 1 : 2)
+
+
+/*
+ * The tag of an invalidated soa way. No real tag has its low bit set, as the
+ * set index bits are cleared and there is at least one of them.
+ */
+#define SOA_HOLE 1
+
+#define BATCH_CAPACITY 4096
+
+/*
+ * A TraceBatch holds up to BATCH_CAPACITY decoded trace records, stored as
+ * parallel arrays so the simulator can walk them without touching text. Only
+ * 'L', 'S', 'M', and 'I' records are kept; everything else is dropped by the
+ * tokenizer. With --cores, core[k] is the core that made record k; the readers
+ * leave it unset.
+ */
+typedef struct TraceBatch {
+    size_t count;
+    uint64_t address[BATCH_CAPACITY];
+    uint32_t size[BATCH_CAPACITY];
+    char op[BATCH_CAPACITY];
+    uint8_t core[BATCH_CAPACITY];
+} TraceBatch;
+
+/*
+ * A binary trace (see csim convert) starts with the 8 bytes of BINARY_MAGIC
+ * and is followed by blocks. Each block is a BlockHeader and then
+ * stored_bytes of payload, which inflate with codec to raw_bytes of
+ * record_count records. A record is one byte with the operation (0 'L', 1 'S',
+ * 2 'M', 3 'I') in its high nibble and the size in its low nibble, or 0 there
+ * and the size as a varint after it, followed by the zigzag varint difference
+ * from the previous address of the block. The first address of a block is
+ * relative to zero so that blocks decode independently. Integers are
+ * little-endian, varints are LEB128.
+ *
+ * A block holds at most BATCH_CAPACITY records, so it decodes into exactly
+ * one TraceBatch.
+ */
+#define BINARY_MAGIC "CSIMTRC1"
+#define BINARY_MAGIC_BYTES 8
+#define BLOCK_MAX_RAW_BYTES (BATCH_CAPACITY * 16)
+
+typedef struct BlockHeader {
+    uint32_t record_count;
+    uint32_t raw_bytes;
+    uint32_t stored_bytes;
+    uint32_t codec;
+} BlockHeader;
+
+typedef enum Codec {
+    CODEC_NONE,
+    CODEC_ZSTD,
+    CODEC_LZ4,
+} Codec;
+
+/*
+ * A checkpoint (--checkpoint) starts with a CheckpointHeader and then has,
+ * for each cache, a CacheSnapshot, with the counters of its -j workers added
+ * in, and its sets. The header holds the records
+ * simulated and where to resume: the byte offset of the line (or block) of the
+ * trace that the first record not yet simulated is in, resume_skip records
+ * after the start of that line or block (counting only those the filter
+ * keeps), and the trace_records decoded before it. A soa cache stores its arrays
+ * as they are: soa_size, soa_tags, soa_age, policy_state, and under --write
+ * dirty. A list or hash
+ * cache stores, for each set, its line count as a uint32_t and then the tags
+ * of its lines from the least to the most recently used, and is restored by
+ * accessing them in that order.
+ */
+#define CHECKPOINT_MAGIC "CSIMCKP4"
+#define CHECKPOINT_RECORDS ((uint64_t) 1 << 28)
+
+typedef struct CheckpointHeader {
+    char magic[8];
+    uint64_t record_count;
+    uint64_t resume_offset;
+    uint64_t resume_skip;
+    uint64_t trace_records;
+    uint32_t cache_count;
+    uint32_t reserved;
+} CheckpointHeader;
+
+typedef struct CacheSnapshot {
+    int32_t set_bit_count;
+    int32_t lines_per_set;
+    int32_t offset_bit_count;
+    int32_t engine;
+    int32_t policy;
+    int32_t write_mode;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t find_probes;
+    uint64_t dirty_evictions;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+} CacheSnapshot;
+
+/*
+ * A StreamReader reads a pipe, FIFO, or stdin on its own thread, so that
+ * reading overlaps with simulation. The reader thread fills STREAM_BUFFERS
+ * buffers in turn, each with up to STREAM_BUFFER_BYTES of data after
+ * STREAM_HEADROOM bytes of room, into which the consumer moves the partial
+ * last line of the previous buffer so that every line it tokenizes is
+ * contiguous.
+ *
+ * Buffer k of the stream is buffers[k % STREAM_BUFFERS] and is ready once
+ * filled > k. The consumer takes buffers in order by advancing next and gives
+ * them back in order by advancing released; the reader thread only refills a
+ * buffer after it has been given back. cursor and cursor_length track the
+ * unread rest of the current buffer for stream_read.
+ */
+#define STREAM_BUFFERS 2
+#define STREAM_BUFFER_BYTES (8 << 20)
+#define STREAM_HEADROOM (64 << 10)
+
+typedef struct StreamReader {
+    int fd;
+    pthread_t thread;
+    char *buffers[STREAM_BUFFERS];
+    size_t lengths[STREAM_BUFFERS];
+    uint64_t filled;
+    uint64_t next;
+    uint64_t released;
+    int eof;
+    int error;
+    int closed;
+    const char *cursor;
+    size_t cursor_length;
+    uint64_t byte_count;
+    double wait_seconds;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} StreamReader;
+
+/*
+ * How the levels of a Hierarchy share blocks. NINE levels fill on every miss
+ * and evict independently. Inclusive levels do the same, but evicting from a
+ * lower level also invalidates the block in every level above it. Exclusive
+ * levels hold each block in at most one of the first level and the lower
+ * levels: a lower-level hit moves the block up, only the first level fills
+ * from a miss, and the lower levels fill only with what the level above
+ * evicts.
+ */
+typedef enum Inclusion {
+    INCLUSION_NINE,
+    INCLUSION_INCLUSIVE,
+    INCLUSION_EXCLUSIVE,
+} Inclusion;
+
+/*
+ * A Hierarchy sends 'L', 'S', and 'M' records to l1d and 'I' records to l1i
+ * (or drops them if there is none), and each miss on to lower[0] (L2) and
+ * then lower[1] (LLC). Every level runs on the soa layout, and no level has
+ * smaller blocks than a level above it.
+ */
+#define MAX_LOWER_LEVELS 2
+
+typedef struct Hierarchy {
+    Cache *l1d;
+    Cache *l1i;
+    Cache *lower[MAX_LOWER_LEVELS];
+    int lower_count;
+    Inclusion inclusion;
+    int split_lines;
+} Hierarchy;
+
+/*
+ * level_access returns NO_VICTIM when it evicts nothing. A victim address
+ * always has its offset bits (at least one) clear.
+ */
+#define NO_VICTIM UINT64_MAX
+
+#define RING_BATCHES 4
+#define RING_SPINS 256
+
+/*
+ * With -j, worker w owns the sets from w * set_count / worker_count up to
+ * (w + 1) * set_count / worker_count and simulates them on its own copy of the
+ * Cache, which shares the set storage but has its own counters. Under a
+ * coherence Protocol it has such a copy of the cache of each of the
+ * core_count cores in cores instead, which all have the same sets.
+ *
+ * The reader thread appends each record to the batch at
+ * ring[head % RING_BATCHES] of the worker owning its set and publishes the
+ * batch by advancing head once it is full. The worker simulates batches up to
+ * head and hands each one back by advancing tail. head and tail each have a
+ * single writer, so the ring needs no lock.
+ *
+ * A side that finds the ring empty (or full) yields RING_SPINS times and then
+ * sleeps on changed. sleepers counts those asleep; after moving head, tail, or
+ * done, the other side takes lock to wake them only if it is nonzero.
+ */
+typedef struct Worker {
+    pthread_t thread;
+    Cache cache;
+    Cache *cores;
+    int core_count;
+    TraceBatch *ring;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    int done;
+    int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Worker;
+
+/*
+ * With --cores, each core's trace is read by its own thread, which hands its
+ * batches over through the ring of feed as the -j reader does to a worker.
+ * The main thread interleaves the records of the cores one at a time.
+ */
+typedef struct CoreTrace {
+    const char *path;
+    pthread_t thread;
+    Worker feed;
+    int status;
+    uint64_t byte_count;
+} CoreTrace;
+
+/*
+ * An OutputWriter writes a stream (the --interval rows) from its own thread,
+ * so that the simulation only has to copy each row into a buffer. The
+ * producer fills buffers[filled % OUTPUT_BUFFERS] and hands it over by
+ * advancing filled; the writer thread writes buffers up to filled and hands
+ * them back by advancing written. The producer only waits if every buffer is
+ * still being written.
+ */
+#define OUTPUT_BUFFERS 4
+#define OUTPUT_BUFFER_BYTES (1 << 20)
+
+typedef struct OutputWriter {
+    int fd;
+    pthread_t thread;
+    char *buffers[OUTPUT_BUFFERS];
+    size_t lengths[OUTPUT_BUFFERS];
+    uint64_t filled;
+    uint64_t written;
+    int closed;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} OutputWriter;
+
+/*
+ * The records a Filter keeps, of those the readers decode: from the skip-th
+ * on, at most limit of them (0 for all), and only those whose operation has
+ * keep_op set and, if there are any ranges, whose address falls in one of
+ * [range_start[k], range_end[k]).
+ */
+#define FILTER_MAX_RANGES 16
+
+typedef struct Filter {
+    uint64_t skip;
+    uint64_t limit;
+    uint8_t keep_op[256];
+    int range_count;
+    uint64_t range_start[FILTER_MAX_RANGES];
+    uint64_t range_end[FILTER_MAX_RANGES];
+} Filter;
+
+/*
+ * A Simulation is what the trace readers feed. Each batch is simulated on
+ * every one of caches in turn or, with worker_count workers (which requires a
+ * single cache), split between them by set. With a hierarchy, caches are its
+ * levels and the batch goes through the hierarchy instead. With --cores,
+ * caches are the private caches of the cores, and workers split the sets of
+ * all of them alike. A core's reader has a Simulation of its own, which only
+ * passes its batches on to feed.
+ *
+ * With split_lines, a record whose bytes span several blocks of a cache is
+ * simulated on that cache as one record per block, expanded into split_batch
+ * (see split_batch).
+ *
+ * The readers and consume_batch also keep the totals that --stats reports:
+ * the bytes of trace read, the records decoded, the time spent simulating
+ * them (including routing them to workers), and the time spent waiting for a
+ * streamed trace to arrive. Each is taken once per batch or buffer, never per
+ * record.
+ *
+ * With --interval, consume_batch cuts the trace every interval records and
+ * writes a row of the counters each cache gained since the last cut, kept in
+ * interval_last, to interval_writer. interval_left counts down the records
+ * still to go.
+ *
+ * With --checkpoint, consume_batch also writes a checkpoint to
+ * checkpoint_path every checkpoint_period records, when record_count reaches
+ * next_checkpoint. The readers set batch_offset to the byte offset of the
+ * line (or block) the batch they feed starts at, and consume_batch keeps in
+ * batch_done how many of its records it has consumed and in
+ * batch_trace_records the trace_records before it, which is where a
+ * checkpoint resumes. A resumed run drops the first skip_records records it
+ * is fed: those after resume_offset that the checkpoint holds, if its reader
+ * can start there (see resume_at), or else all of them. Batches that have to
+ * be cut are copied a piece at a time into slice_batch.
+ *
+ * With --warmup, cold_count caches are still warming up, cold[k] set for
+ * each: they are simulated but their counters are zeroed when the first
+ * warmup records have been consumed or, with warmup_full, when all of their
+ * lines have been filled; see end_warmup.
+ *
+ * With a filter, consume_batch first copies the records the filter keeps
+ * into filter_batch, and everything after sees only those. trace_records
+ * counts the records decoded before filtering. limit_reached tells the
+ * readers that no more records will be kept, so they can stop early.
+ */
+typedef struct Simulation {
+    Cache *caches;
+    int cache_count;
+    int worker_count;
+    Worker *workers;
+    int parser_count;
+    Hierarchy *hierarchy;
+    int split_lines;
+    TraceBatch *split_batch;
+    uint64_t byte_count;
+    uint64_t record_count;
+    double simulate_seconds;
+    double wait_seconds;
+    uint64_t interval;
+    uint64_t interval_left;
+    Counters *interval_last;
+    OutputWriter *interval_writer;
+    TraceBatch *slice_batch;
+    Worker *feed;
+    const char *checkpoint_path;
+    uint64_t checkpoint_period;
+    uint64_t next_checkpoint;
+    int checkpoint_error;
+    uint64_t batch_offset;
+    uint64_t batch_done;
+    uint64_t batch_trace_records;
+    uint64_t skip_records;
+    uint64_t resume_offset;
+    uint64_t resume_skip;
+    uint64_t resume_trace_records;
+    uint64_t warmup;
+    int warmup_full;
+    int cold_count;
+    uint8_t *cold;
+    const Filter *filter;
+    TraceBatch *filter_batch;
+    uint64_t trace_records;
+    int limit_reached;
+} Simulation;
+
+/*
+ * With --parse-threads, a mapped trace is cut into CHUNK_BYTES chunks and
+ * parser p tokenizes chunks p, p + parser_count, ... into ParsedChunks. Chunk
+ * c goes to slot c % (2 * parser_count) once the reader has consumed chunk c
+ * minus that many, so every parser can run up to two chunks ahead. The reader
+ * consumes the chunks strictly in order. A chunk owns the lines that start
+ * in it.
+ */
+#define CHUNK_BYTES (4 << 20)
+
+typedef struct ParsedChunk {
+    uint64_t chunk;
+    int ready;
+    int bad;
+    size_t batch_count;
+    size_t batch_capacity;
+    TraceBatch *batches;
+    uint64_t *batch_offsets;
+} ParsedChunk;
+
+typedef struct ChunkParser {
+    pthread_t thread;
+    int id;
+    struct ChunkedTrace *trace;
+} ChunkParser;
+
+typedef struct ChunkedTrace {
+    const char *data;
+    const char *end;
+    uint64_t chunk_count;
+    int parser_count;
+    ParsedChunk *slots;
+    ChunkParser *parsers;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ChunkedTrace;
+
+static int initialize(Cache *c);
+static Policy parse_policy(const char *name);
+static Engine parse_engine(const char *name);
+static void cleanup(Cache *c);
+static void *sparse_calloc(uint64_t count, size_t size);
+static void sparse_free(void *block);
+static int check_config(const Cache *c);
+static void simulate_single_access(Cache *c, CacheSet *curr_set, uint64_t tag);
+static uint64_t simulate_soa_access(Cache *c, uint64_t i, uint64_t tag);
+static uint64_t level_access(Cache *c, uint64_t address);
+static int level_probe(const Cache *c, uint64_t address);
+static void simulate_hash_access(Cache *c, uint64_t i, uint64_t tag);
+static int initialize_soa(Cache *c);
+static int initialize_hash(Cache *c);
+static uint32_t *hash_slot(const Cache *c, uint32_t *index, const void *entries,
+                           size_t entry_size, uint64_t tag);
+static void hash_remove(const Cache *c, uint32_t *index, const void *entries,
+                        size_t entry_size, uint32_t *slot);
+static int initialize_stack(Cache *c);
+static void simulate_stack_access(Cache *c, uint64_t i, uint64_t tag);
+static uint32_t stack_insert_newest(StackNode *nodes, uint32_t root, uint32_t n);
+static uint32_t stack_erase(StackNode *nodes, uint32_t root, uint64_t time);
+static uint32_t stack_merge(StackNode *nodes, uint32_t a, uint32_t b);
+static uint32_t stack_oldest(const StackNode *nodes, uint32_t root);
+static uint32_t stack_newer_count(const StackNode *nodes, uint32_t root, uint64_t time);
+static uint64_t soa_match(const uint64_t *tags, uint64_t stride, uint64_t tag);
+static void simulate_fifo_batch(Cache *c, const TraceBatch *batch);
+static void simulate_random_batch(Cache *c, const TraceBatch *batch);
+static void simulate_plru_batch(Cache *c, const TraceBatch *batch);
+static void simulate_nru_batch(Cache *c, const TraceBatch *batch);
+static void simulate_srrip_batch(Cache *c, const TraceBatch *batch);
+static void simulate_brrip_batch(Cache *c, const TraceBatch *batch);
+static void simulate_lfu_batch(Cache *c, const TraceBatch *batch);
+static void simulate_access(Cache *c, char operation, uint64_t address);
+static void simulate_batch(Cache *c, const TraceBatch *batch);
+static int initialize_sample(Cache *c);
+static void detail_batch(Cache *c, const TraceBatch *batch);
+static void classify_miss(Cache *c, uint64_t address, int missed);
+static int block_set_insert(BlockSet *set, uint64_t block);
+static int initialize_breakdown(Cache *c);
+static int initialize_prefetchers(Cache *c);
+static void prefetcher_batch(Cache *c, const TraceBatch *batch);
+static void prefetcher_access(Cache *c, uint64_t address);
+static void prefetch_train(Cache *c, uint64_t block, int triggered);
+static void prefetch_block(Cache *c, uint64_t block, uint64_t page);
+static void note_fill(Cache *c, uint64_t address, uint64_t victim, int prefetched);
+static int initialize_coherence(Cache *c);
+static void write_batch(Cache *c, const TraceBatch *batch);
+static void write_access(Cache *c, uint64_t address, uint32_t size, int store);
+static CacheLine *find(CacheSet *set, uint64_t tag, uint64_t *probes);
+static CacheLine *evict(CacheSet *set, CacheLine *line);
+static CacheLine *push(CacheSet *set, CacheLine *line);
+
+#ifndef CSIM_LIBRARY
+static int convert_hex_digit(char digit);
+static uint64_t convert_hex_string(char *string);
+static int parse_sweep(char *spec, const Cache *base, Cache **caches, int *cache_count);
+static int parse_sweep_field(char *field, int *values, int capacity);
+static int parse_geometry(const char *spec, Cache *c);
+static int level_invalidate(Cache *c, uint64_t address);
+static uint64_t level_insert(Cache *c, uint64_t address);
+static void back_invalidate(const Hierarchy *h, int level, uint64_t victim, int bits);
+static void hierarchy_access(const Hierarchy *h, Cache *first, uint64_t address);
+static void simulate_hierarchy_batch(const Hierarchy *h, const TraceBatch *batch);
+static void stack_counters(const Cache *c, int lines, uint64_t *hits,
+                           uint64_t *misses, uint64_t *evictions);
+static void parse_operation(char *trace_line, char *operation, uint64_t *address);
+static int parse_breakdown(char *spec);
+static void print_breakdown(const Cache *c, int sweep);
+static int parse_prefetchers(char *spec);
+static void print_prefetchers(const Cache *c, int sweep);
+static void clear_counters(Cache *c);
+static void reset_counters(Cache *c);
+static uint64_t fills_left(const Cache *c);
+static void end_warmup(Simulation *sim);
+static void add_counters(Cache *to, const Cache *from);
+static void coherence_batch(Cache *cores, int core_count, const TraceBatch *batch);
+static void coherence_access(Cache *cores, int core_count, int core, uint64_t address, int store);
+static int lost_tag(const Cache *c, uint64_t i, uint64_t tag);
+static int simulate_fd(int fd, Simulation *sim);
+static const TraceBatch *slice(Simulation *sim, const TraceBatch *batch, size_t start, size_t n);
+static int write_checkpoint(const Simulation *sim, const char *path);
+static int read_checkpoint(Simulation *sim, const char *path);
+static uint64_t resume_at(Simulation *sim);
+static int simulate_cores(CoreTrace *cores, int core_count, Simulation *sim);
+static void *run_core_reader(void *arg);
+static void feed_batch(Worker *w, const TraceBatch *batch);
+static int parse_write_mode(char *spec);
+static double sample_estimate(const Cache *c, int counter, double *interval);
+static int parse_sample(const char *spec, Cache *c);
+static void consume_batch(Simulation *sim, const TraceBatch *batch);
+static const TraceBatch *filter_batch(Simulation *sim, const TraceBatch *batch);
+static int parse_ranges(char *spec, Filter *filter);
+static int parse_ops(const char *spec, Filter *filter);
+static void dispatch_batch(Simulation *sim, const TraceBatch *batch);
+static void time_batch(Simulation *sim, const TraceBatch *batch);
+static void write_interval(Simulation *sim);
+static void write_interval_header(Simulation *sim);
+static int output_open(OutputWriter *writer, int fd);
+static int output_close(OutputWriter *writer);
+static void *run_output_writer(void *arg);
+static void output_append(OutputWriter *writer, const char *data, size_t length);
+static void print_stats(const Simulation *sim, double seconds);
+static void route_batch(Simulation *sim, const TraceBatch *batch);
+static void split_batch(const TraceBatch *batch, int bits, size_t *next, uint64_t *done,
+                        TraceBatch *out);
+static int start_workers(Simulation *sim);
+static void finish_workers(Simulation *sim);
+static void *run_worker(void *arg);
+static void publish_batch(Worker *w);
+static int ring_ready(Worker *w, int free_slots);
+static void wait_ring(Worker *w, int free_slots);
+static void drain_workers(Simulation *sim);
+static void wake_ring(Worker *w);
+static int simulate_mapped_trace(int fd, off_t length, Simulation *sim);
+static int simulate_chunked_trace(const char *data, const char *end, uint64_t offset,
+                                  Simulation *sim);
+static void *run_chunk_parser(void *arg);
+static const char *chunk_start(const ChunkedTrace *trace, uint64_t chunk);
+static int parse_chunk(const ChunkedTrace *trace, uint64_t chunk, ParsedChunk *out);
+static int simulate_stream_trace(int fd, Simulation *sim);
+static int simulate_mapped_binary(const char *data, const char *end, uint64_t offset,
+                                  Simulation *sim);
+static int simulate_stream_binary(StreamReader *reader, uint64_t offset, Simulation *sim);
+static int stream_open(StreamReader *reader, int fd);
+static void stream_close(StreamReader *reader);
+static void *run_stream_reader(void *arg);
+static char *stream_next(StreamReader *reader, size_t *length);
+static void stream_release(StreamReader *reader);
+static size_t stream_read(StreamReader *reader, void *dst, size_t n);
+static int convert_trace(int argc, char *argv[]);
+static size_t encode_block(const TraceBatch *batch, uint8_t *out);
+static int decode_block(const BlockHeader *header, const uint8_t *stored,
+                        uint8_t *scratch, TraceBatch *batch);
+static size_t compress_block(Codec codec, const uint8_t *raw, size_t raw_bytes,
+                             uint8_t *out, size_t capacity);
+static size_t compress_bound(Codec codec, size_t raw_bytes);
+static const char *tokenize_trace(const char *p, const char *end, TraceBatch *batch);
+static const char *tokenize_line(const char *line, const char *comma,
+                                 const char *newline, const char *end,
+                                 TraceBatch *batch);
+static uint64_t decode_hex_span(const char *p, const char *q, const char *end);
+static int parse_benchmark(int argc, char *argv[]);
+static int run_benchmark(int argc, char *argv[]);
+static int run_verify(int argc, char *argv[]);
+static int verify_trace(const char *name, const Cache *caches, int cache_count,
+                        const TraceBatch *batches, size_t batch_count, int worker_count,
+                        int repetitions, int *mismatches);
+static int list_counters(const Cache *c, int lines, const TraceBatch *batches,
+                         size_t batch_count, Counters *counters);
+static int load_trace(const char *path, TraceBatch **batches, size_t *batch_count);
+static int generate_trace(const char *pattern, uint64_t working_set, TraceBatch *batches,
+                          size_t batch_count);
+static double seconds_now();
+#endif
+
+#define BUFFER_SIZE 100
+
+/*
+ * ENGINE_AUTO switches from list to hash at HASH_MIN_LINES lines per set. On
+ * synthetic uniform-random traces hash already wins at 16 lines when most
+ * accesses hit, but only from about 48 when nearly all miss (a miss costs
+ * three probes and a removal).
+ */
+#define HASH_MIN_LINES 32
+#define SOA_MAX_LINES 64
+
+/*
+ * A sweep may not expand to more than MAX_SWEEP_CACHES configurations, and
+ * each of its fields to more than MAX_SWEEP_VALUES values.
+ */
+#define MAX_SWEEP_CACHES 4096
+#define MAX_SWEEP_VALUES 64
+
+#define MAX_WORKERS 256
+
+/*
+ * The patterns csim bench can generate, and the matrix of geometries (a sweep
+ * spec) it runs them on by default: from direct-mapped with tiny blocks to
+ * 256-way, which only the list, hash, and stack engines can do.
+ */
+#define BENCH_PATTERNS "stream,stride,uniform,zipf,chase"
+#define BENCH_MATRIX "4:1:4,6:4:5,8:8:6,10:16:6,6:64:6,4:256:6"
+#define BENCH_STRIDE 320
+#define BENCH_ZIPF_EXPONENT 0.99
+#define VERIFY_WORKERS 4
+
+/*
+ * SRRIP and BRRIP keep a 2-bit re-reference prediction value per way. BRRIP
+ * inserts at RRPV_LONG only once every BRRIP_LONG_ODDS fills, and at
+ * RRPV_DISTANT otherwise.
+ */
+#define RRPV_DISTANT 3
+#define RRPV_LONG 2
+#define BRRIP_LONG_ODDS 32
+
+enum {
+    OPT_SWEEP = 256,
+    OPT_MRC,
+    OPT_PARSE_THREADS,
+    OPT_L1I,
+    OPT_L2,
+    OPT_LLC,
+    OPT_INCLUSION,
+    OPT_SPLIT_LINES,
+    OPT_SAMPLE_SETS,
+    OPT_BREAKDOWN,
+    OPT_STATS,
+    OPT_INTERVAL,
+    OPT_INTERVAL_OUT,
+    OPT_DEDUP,
+    OPT_PREFETCH_DISTANCE,
+    OPT_PREFETCHER,
+    OPT_WRITE,
+    OPT_CORES,
+    OPT_COHERENCE,
+    OPT_CHECKPOINT,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_RESUME,
+    OPT_WARMUP,
+    OPT_ADDRESS_RANGE,
+    OPT_OPS,
+    OPT_SKIP,
+    OPT_LIMIT,
+};
+
+#ifndef CSIM_LIBRARY
+static const struct option long_options[] = {
+    {"sweep", required_argument, NULL, OPT_SWEEP},
+    {"mrc", no_argument, NULL, OPT_MRC},
+    {"parse-threads", required_argument, NULL, OPT_PARSE_THREADS},
+    {"l1i", required_argument, NULL, OPT_L1I},
+    {"l2", required_argument, NULL, OPT_L2},
+    {"llc", required_argument, NULL, OPT_LLC},
+    {"inclusion", required_argument, NULL, OPT_INCLUSION},
+    {"split-lines", no_argument, NULL, OPT_SPLIT_LINES},
+    {"sample-sets", required_argument, NULL, OPT_SAMPLE_SETS},
+    {"breakdown", required_argument, NULL, OPT_BREAKDOWN},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"interval", required_argument, NULL, OPT_INTERVAL},
+    {"interval-out", required_argument, NULL, OPT_INTERVAL_OUT},
+    {"dedup", no_argument, NULL, OPT_DEDUP},
+    {"prefetch-distance", required_argument, NULL, OPT_PREFETCH_DISTANCE},
+    {"prefetcher", required_argument, NULL, OPT_PREFETCHER},
+    {"write", required_argument, NULL, OPT_WRITE},
+    {"cores", required_argument, NULL, OPT_CORES},
+    {"coherence", required_argument, NULL, OPT_COHERENCE},
+    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+    {"checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL},
+    {"resume", optional_argument, NULL, OPT_RESUME},
+    {"warmup", required_argument, NULL, OPT_WARMUP},
+    {"address-range", required_argument, NULL, OPT_ADDRESS_RANGE},
+    {"ops", required_argument, NULL, OPT_OPS},
+    {"skip", required_argument, NULL, OPT_SKIP},
+    {"limit", required_argument, NULL, OPT_LIMIT},
+    {NULL, 0, NULL, 0},
+};
+#endif
+
+/*
+ * You must specify the following as command-line arguments: number of bits used
+ * for the set index, number of lines per set, number of bits used for the
+ * offset, path to a valgrind memory trace. The path may be "-" for stdin or
+ * name a FIFO, so that csim can read straight from valgrind --tool=lackey.
+ *
+ * -s 0 makes the cache a single fully-associative set, as for a TLB or a
+ * victim cache. It runs on the list, hash, or stack engine only, so not with
+ * -e soa or anything that takes soa: another policy, --prefetcher, --write, a
+ * hierarchy, or --cores.
+ *
+ * Alternatively --sweep=<spec> simulates several caches over a single pass of
+ * the trace and prints one line per cache; see parse_sweep. -s, -E, and -b are
+ * then not needed.
+ *
+ * --mrc runs the stack engine and prints the miss-ratio curve of each cache
+ * instead: one line for every associativity from 1 to -E.
+ *
+ * -p lru|fifo|random|plru|nru|srrip|brrip|lfu picks the replacement policy,
+ * LRU by default. PLRU needs a power-of-two -E.
+ *
+ * --l1i=s:E:b, --l2=s:E:b, and --llc=s:E:b turn the cache of -s, -E, and -b
+ * into the L1D of a hierarchy with an instruction cache for 'I' records, an
+ * L2, and a last-level cache, any of which may be left out, and print one line
+ * per level. --inclusion=nine|inclusive|exclusive picks how the levels share
+ * blocks, NINE by default; see Inclusion. Every level uses -p and the soa
+ * engine.
+ *
+ * --split-lines simulates an access whose size carries it past the end of its
+ * block as one access to every block it touches. Without it every access
+ * touches one block, as in the lab.
+ *
+ * --sample-sets=K[:hash] simulates only every K-th set (or, with :hash, a
+ * hashed one in K) and reports each counter scaled up to the whole cache,
+ * followed by the half-width of its 95% confidence interval. Records for the
+ * other sets are dropped as soon as they are decoded.
+ *
+ * --breakdown=ops,sets,misses (any of them) also prints the counters of each
+ * operation and of each set, and splits the misses into cold, capacity, and
+ * conflict misses; see Cache.breakdown. Under --sample-sets these count the
+ * sampled sets only, unscaled.
+ *
+ * --stats prints to stderr where the time went: reading, parsing, and
+ * simulating, the throughput of each, the average find() probe length of the
+ * list engine, and the peak RSS. See print_stats.
+ *
+ * --interval=N writes a CSV row every N trace records with the hits, misses,
+ * and evictions of each cache over those records, to the --interval-out file
+ * or else stdout, ahead of the usual summary.
+ *
+ * --dedup counts an access to the block last accessed in its set as a hit
+ * without simulating it: under LRU that block is already the most recently
+ * used, so the results are the same. Not with other policies or a hierarchy.
+ *
+ * --prefetch-distance=N sets how many records ahead the simulation prefetches
+ * the sets of a cache of PREFETCH_MIN_SETS sets or more (default
+ * PREFETCH_DISTANCE, 0 for none).
+ *
+ * --prefetcher=next-line,stride,stream (any of them) models hardware
+ * prefetchers that watch the accesses and fill the cache with the blocks they
+ * predict, and prints how many prefetched blocks were used, evicted unused,
+ * and made others leave; see Prefetcher. Prefetches never leave the 4 KB page
+ * of the access that triggered them. As with the policies, this takes the
+ * soa engine.
+ *
+ * --write=back|through[,allocate|,no-allocate] models what stores do: mark
+ * the line dirty, to be written back when it is evicted, or write through to
+ * memory at once; and whether a store miss fills the line (the default of
+ * write-back) or only writes memory (the default of write-through). It
+ * prints the dirty evictions and the bytes read from and written to memory.
+ * Lines still dirty at the end are not written back. This takes the soa
+ * engine too.
+ *
+ * --cores=<trace>,<trace>,... simulates one core per trace, each with its own
+ * cache of the -s, -E, and -b geometry, taking one record from each core in
+ * turn, under the --coherence=mesi (the default) or moesi protocol. It prints
+ * the counters of each core; see Cache.protocol. -j splits the sets of all the
+ * cores between the workers. This takes the soa engine too.
+ *
+ * --checkpoint=path writes the state of every cache (its lines, their order,
+ * the dirty lines under --write, and the counters) and the number of trace
+ * records simulated to path every --checkpoint-interval records (default
+ * CHECKPOINT_RECORDS) and at the end; with -j, the workers first finish the
+ * records before it. --resume[=path] starts from the checkpoint at path, or
+ * else at the --checkpoint path, with the same caches and trace, and any -j.
+ * A trace in a file is read from the line the checkpoint stopped in; a pipe
+ * is read from the start, skipping the records the checkpoint holds. Only a
+ * single cache or a --sweep can be checkpointed, not --mrc or -e stack, a
+ * hierarchy, --cores, or the options that keep more state than the lines
+ * (sampling, breakdowns, prefetchers).
+ *
+ * --warmup=N simulates the first N trace records without counting them: all
+ * counters, those of --sample-sets, --breakdown, and --mrc included, start
+ * from zero after them, and --interval rows report zeros until then.
+ * --warmup=full does the same for each cache until every one of its sets (or
+ * of its sampled sets) holds -E lines. Not with -j, a hierarchy, or --cores;
+ * full not with --mrc, --split-lines, prefetchers, a write-no-allocate
+ * cache, or checkpoints either, where the misses do not tell the lines.
+ *
+ * --address-range=lo-hi[,lo-hi...] keeps only the records whose address (in
+ * hex) is in one of the ranges, from lo up to but not including hi.
+ * --ops=<letters> keeps only the records of those operations, any of L, S,
+ * M, and I. --skip=N drops the first N records of the trace, and --limit=N
+ * stops reading it N records after those. Skip and limit count every
+ * record, and the other filters then pick among the ones left. All of this
+ * happens to the decoded records before anything is simulated, and
+ * --interval, --warmup, and --checkpoint count only the records kept.
+ *
+ * -j <n> splits the sets of a single cache between n worker threads.
+ * --parse-threads=<n> tokenizes a mapped trace with n threads.
+ *
+ * The trace may be a valgrind text trace or a binary trace written by
+ * csim convert; the format is detected from the first bytes.
+ */
+#ifndef CSIM_LIBRARY
+int main(int argc, char* argv[])
+{
+    int opt;
+    char *t = NULL;
+    char *sweep = NULL;
+    int mrc = 0;
+    int worker_count = 1;
+    int parser_count = 1;
+    char *level_specs[1 + MAX_LOWER_LEVELS] = {NULL};
+    int inclusion = INCLUSION_NINE;
+    int split_lines = 0;
+    int stats = 0;
+    long interval = 0;
+    char *core_spec = NULL;
+    char *checkpoint = NULL;
+    char *resume = NULL;
+    long checkpoint_period = CHECKPOINT_RECORDS;
+    long warmup = 0;
+    int warmup_full = 0;
+    Filter filter = {0};
+    int filtered = 0;
+    memset(filter.keep_op, 1, sizeof(filter.keep_op));
+    char *interval_out = NULL;
+    Cache base = {0};
+    base.sample_period = 1;
+    base.prefetch_distance = PREFETCH_DISTANCE;
+
+    if (argc > 1 && strcmp(argv[1], "parsebench") == 0) {
+        return parse_benchmark(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "convert") == 0) {
+        return convert_trace(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return run_benchmark(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+        return run_verify(argc - 1, argv + 1);
+    }
+
+    while ((opt = getopt_long(argc, argv, "s:E:b:t:e:j:p:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            base.set_bit_count = atoi(optarg);
+            break;
+        case 'E':
+            base.lines_per_set = atoi(optarg);
+            break;
+        case 'b':
+            base.offset_bit_count = atoi(optarg);
+            break;
+        case 't':
+            t = optarg;
+            break;
+        case 'e':
+            base.engine = parse_engine(optarg);
+            break;
+        case 'j':
+            worker_count = atoi(optarg);
+            break;
+        case 'p':
+            base.policy = parse_policy(optarg);
+            break;
+        case OPT_SWEEP:
+            sweep = optarg;
+            break;
+        case OPT_PARSE_THREADS:
+            parser_count = atoi(optarg);
+            break;
+        case OPT_MRC:
+            mrc = 1;
+            base.engine = ENGINE_STACK;
+            break;
+        case OPT_L1I:
+            level_specs[0] = optarg;
+            break;
+        case OPT_L2:
+            level_specs[1] = optarg;
+            break;
+        case OPT_LLC:
+            level_specs[2] = optarg;
+            break;
+        case OPT_SPLIT_LINES:
+            split_lines = 1;
+            break;
+        case OPT_STATS:
+            stats = 1;
+            break;
+        case OPT_INTERVAL:
+            interval = atol(optarg);
+            interval = interval > 0 ? interval : -1;
+            break;
+        case OPT_INTERVAL_OUT:
+            interval_out = optarg;
+            break;
+        case OPT_DEDUP:
+            base.dedup = 1;
+            break;
+        case OPT_PREFETCH_DISTANCE:
+            base.prefetch_distance = atoi(optarg);
+            break;
+        case OPT_PREFETCHER:
+            base.prefetchers = parse_prefetchers(optarg);
+            break;
+        case OPT_WRITE:
+            base.write_mode = parse_write_mode(optarg);
+            break;
+        case OPT_CORES:
+            core_spec = optarg;
+            break;
+        case OPT_CHECKPOINT:
+            checkpoint = optarg;
+            break;
+        case OPT_CHECKPOINT_INTERVAL:
+            checkpoint_period = atol(optarg);
+            break;
+        case OPT_RESUME:
+            resume = optarg != NULL ? optarg : "";
+            break;
+        case OPT_WARMUP:
+            if (strcmp(optarg, "full") == 0) {
+                warmup_full = 1;
+            }
+            else {
+                char *end;
+                warmup = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || warmup <= 0) {
+                    warmup = -1;
+                }
+            }
+            break;
+        case OPT_ADDRESS_RANGE:
+            if (parse_ranges(optarg, &filter) == 1) {
+                filtered = -1;
+            }
+            else if (filtered == 0) {
+                filtered = 1;
+            }
+            break;
+        case OPT_OPS:
+            if (parse_ops(optarg, &filter) == 1) {
+                filtered = -1;
+            }
+            else if (filtered == 0) {
+                filtered = 1;
+            }
+            break;
+        case OPT_SKIP:
+        case OPT_LIMIT: {
+            char *end;
+            long long n = strtoll(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || n < (opt == OPT_LIMIT)) {
+                filtered = -1;
+            }
+            else {
+                *(opt == OPT_SKIP ? &filter.skip : &filter.limit) = n;
+                if (filtered == 0) {
+                    filtered = 1;
+                }
+            }
+            break;
+        }
+        case OPT_COHERENCE:
+            base.protocol = strcmp(optarg, "mesi") == 0 ? PROTOCOL_MESI
+                            : strcmp(optarg, "moesi") == 0 ? PROTOCOL_MOESI : -1;
+            break;
+        case OPT_BREAKDOWN:
+            base.breakdown = parse_breakdown(optarg);
+            break;
+        case OPT_SAMPLE_SETS:
+            if (parse_sample(optarg, &base) == 1) {
+                base.sample_period = 0;
+            }
+            break;
+        case OPT_INCLUSION:
+            if (strcmp(optarg, "nine") == 0) {
+                inclusion = INCLUSION_NINE;
+            }
+            else if (strcmp(optarg, "inclusive") == 0) {
+                inclusion = INCLUSION_INCLUSIVE;
+            }
+            else if (strcmp(optarg, "exclusive") == 0) {
+                inclusion = INCLUSION_EXCLUSIVE;
+            }
+            else {
+                inclusion = -1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    Cache *caches;
+    int cache_count;
+    Hierarchy hierarchy = {0};
+    CoreTrace *cores = NULL;
+    int hierarchical = level_specs[0] || level_specs[1] || level_specs[2];
+    if (hierarchical) {
+        // Level 0 is the L1D, then come the L1I, L2, and LLC that were given
+        if (base.engine == ENGINE_AUTO) {
+            base.engine = ENGINE_SOA;
+        }
+        caches = malloc(sizeof(Cache) * (2 + MAX_LOWER_LEVELS));
+        if (caches == NULL || t == NULL || sweep != NULL || mrc || (int) inclusion == -1
+            || core_spec != NULL || base.protocol != PROTOCOL_NONE
+            || base.engine != ENGINE_SOA || check_config(&base) == 1) {
+            printf("Bad arguments\n");
+            return 1;
+        }
+        caches[0] = base;
+        cache_count = 1;
+        int upper_bits = base.offset_bit_count;
+        for (int k = 0; k < 1 + MAX_LOWER_LEVELS; k++) {
+            if (level_specs[k] == NULL) {
+                continue;
+            }
+            Cache *c = &caches[cache_count++];
+            *c = base;
+            if (parse_geometry(level_specs[k], c) == 1 || check_config(c) == 1
+                || (k > 0 && c->offset_bit_count < upper_bits)) {
+                printf("Bad arguments\n");
+                return 1;
+            }
+            upper_bits = c->offset_bit_count > upper_bits ? c->offset_bit_count : upper_bits;
+            if (k == 0) {
+                hierarchy.l1i = c;
+            }
+            else {
+                hierarchy.lower[hierarchy.lower_count++] = c;
+            }
+        }
+        hierarchy.l1d = &caches[0];
+        hierarchy.inclusion = inclusion;
+    }
+    else if (core_spec != NULL) {
+        if (base.protocol == PROTOCOL_NONE) {
+            base.protocol = PROTOCOL_MESI;
+        }
+        if (base.engine == ENGINE_AUTO) {
+            base.engine = ENGINE_SOA;
+        }
+        cores = calloc(MAX_CORES, sizeof(CoreTrace));
+        caches = malloc(sizeof(Cache) * MAX_CORES);
+        if (cores == NULL || caches == NULL || t != NULL || sweep != NULL
+            || (int) base.protocol == -1 || check_config(&base) == 1) {
+            printf("Bad arguments\n");
+            return 1;
+        }
+        cache_count = 0;
+        char *save;
+        for (char *path = strtok_r(core_spec, ",", &save); path != NULL;
+             path = strtok_r(NULL, ",", &save)) {
+            if (cache_count == MAX_CORES) {
+                printf("Bad arguments\n");
+                return 1;
+            }
+            cores[cache_count].path = path;
+            caches[cache_count++] = base;
+        }
+    }
+    else if (sweep != NULL) {
+        if (t == NULL || base.protocol != PROTOCOL_NONE
+            || parse_sweep(sweep, &base, &caches, &cache_count) == 1) {
+            printf("Bad arguments\n");
+            return 1;
+        }
+    }
+    else {
+        if (t == NULL || base.protocol != PROTOCOL_NONE || check_config(&base) == 1) {
+            printf("Bad arguments\n");
+            return 1;
+        }
+        caches = &base;
+        cache_count = 1;
+    }
+    if (worker_count < 1 || worker_count > MAX_WORKERS
+        || (worker_count > 1 && ((cache_count > 1 && cores == NULL) || hierarchical))
+        || base.sample_period == 0
+        || (base.sample_period > 1 && (worker_count > 1 || hierarchical || mrc))
+        || base.breakdown == -1 || (base.breakdown && hierarchical)
+        || interval == -1 || (interval > 0 && worker_count > 1)
+        || (base.dedup && (hierarchical || base.policy != POLICY_LRU))
+        || base.prefetch_distance < 0 || base.prefetch_distance >= BATCH_CAPACITY
+        || base.prefetchers == -1
+        || (base.prefetchers && (hierarchical || worker_count > 1 || mrc || base.dedup
+                                 || base.sample_period > 1 || base.breakdown))
+        || base.write_mode == -1
+        || (base.write_mode && (hierarchical || mrc || base.dedup || base.prefetchers
+                                || base.sample_period > 1 || base.breakdown))
+        || ((base.breakdown & BREAKDOWN_MISSES) && (worker_count > 1 || base.sample_period > 1))
+        || (cores != NULL && (mrc || split_lines || base.dedup || base.prefetchers
+                              || base.write_mode || base.sample_period > 1 || base.breakdown))
+        || checkpoint_period <= 0 || (resume != NULL && *resume == '\0' && checkpoint == NULL)
+        || ((checkpoint != NULL || resume != NULL)
+            && (mrc || base.engine == ENGINE_STACK || hierarchical || cores != NULL
+                || base.prefetchers || base.sample_period > 1 || base.breakdown))
+        || warmup == -1 || filtered == -1
+        || ((warmup > 0 || warmup_full) && (worker_count > 1 || hierarchical || cores != NULL))
+        || (warmup_full && (mrc || split_lines || base.prefetchers
+                            || (base.write_mode & WRITE_NO_ALLOCATE)
+                            || checkpoint != NULL || resume != NULL))
+        || parser_count < 1 || parser_count > MAX_WORKERS) {
+        printf("Bad arguments\n");
+        return 1;
+    }
+
+    int fd = -1;
+    if (cores != NULL) {
+        // Each core's reader opens its own trace
+    }
+    else if (strcmp(t, "-") == 0) {
+        fd = dup(STDIN_FILENO);
+    }
+    else {
+        fd = open(t, O_RDONLY);
+    }
+    if (fd == -1 && cores == NULL) {
+        printf("Bad file\n");
+        return 1;
+    }
+
+    for (int k = 0; k < cache_count; k++) {
+        if (initialize(&caches[k]) == 1) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+    }
+    Simulation sim = {
+        .caches = caches,
+        .cache_count = cache_count,
+        .worker_count = worker_count,
+        .parser_count = parser_count,
+        .split_lines = split_lines,
+    };
+    if (hierarchical) {
+        hierarchy.split_lines = split_lines;
+        sim.hierarchy = &hierarchy;
+    }
+    if (split_lines && (sim.split_batch = malloc(sizeof(TraceBatch))) == NULL) {
+        printf("Bad initialize\n");
+        return 1;
+    }
+    if (warmup > 0 || warmup_full) {
+        sim.warmup = warmup;
+        sim.warmup_full = warmup_full;
+        sim.cold_count = cache_count;
+        sim.cold = malloc(cache_count);
+        if (sim.cold == NULL) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+        memset(sim.cold, 1, cache_count);
+    }
+    if (filtered) {
+        sim.filter = &filter;
+        sim.filter_batch = malloc(sizeof(TraceBatch));
+        if (sim.filter_batch == NULL) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+    }
+    if (interval > 0 || checkpoint != NULL || resume != NULL || sim.cold != NULL) {
+        sim.slice_batch = malloc(sizeof(TraceBatch));
+        if (sim.slice_batch == NULL) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+    }
+    if (resume != NULL && read_checkpoint(&sim, *resume != '\0' ? resume : checkpoint) == 1) {
+        printf("Bad file\n");
+        return 1;
+    }
+    // The workers copy the caches, so they start from the restored ones
+    if (start_workers(&sim) == 1) {
+        printf("Bad initialize\n");
+        return 1;
+    }
+    if (sim.warmup > 0 && sim.record_count >= sim.warmup) {
+        // The checkpoint was written after the warmup, counters and all
+        sim.cold_count = 0;
+    }
+    if (checkpoint != NULL) {
+        sim.checkpoint_path = checkpoint;
+        sim.checkpoint_period = checkpoint_period;
+        sim.next_checkpoint = sim.record_count + checkpoint_period;
+    }
+    OutputWriter interval_writer;
+    if (interval > 0) {
+        int out = interval_out == NULL ? dup(STDOUT_FILENO)
+                  : open(interval_out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out == -1) {
+            printf("Bad file\n");
+            return 1;
+        }
+        sim.interval = interval;
+        sim.interval_left = interval - sim.record_count % interval;
+        sim.interval_writer = &interval_writer;
+        sim.interval_last = calloc(cache_count, sizeof(Counters));
+        if (sim.interval_last == NULL || output_open(&interval_writer, out) == 1) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+        for (int k = 0; k < cache_count; k++) {
+            // Rows of a resumed run start from the counters it resumed with
+            sim.interval_last[k].hits = caches[k].hits;
+            sim.interval_last[k].misses = caches[k].misses;
+            sim.interval_last[k].evictions = caches[k].evictions;
+        }
+        write_interval_header(&sim);
+    }
+    double start = seconds_now();
+    int status = cores != NULL ? simulate_cores(cores, cache_count, &sim) : simulate_fd(fd, &sim);
+    finish_workers(&sim);
+    if (interval > 0) {
+        if (sim.interval_left != sim.interval) {
+            write_interval(&sim);
+        }
+        if (output_close(&interval_writer) == 1) {
+            printf("Bad file\n");
+            return 1;
+        }
+        free(sim.interval_last);
+    }
+    if (checkpoint != NULL && status == 0
+        && (sim.checkpoint_error || write_checkpoint(&sim, checkpoint) == 1)) {
+        printf("Bad file\n");
+        return 1;
+    }
+    free(sim.slice_batch);
+    free(sim.cold);
+    free(sim.filter_batch);
+    if (stats) {
+        print_stats(&sim, seconds_now() - start);
+    }
+    free(sim.split_batch);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (status == -1) {
+        printf("Bad file\n");
+        return 1;
+    }
+    if (status != 0) {
+        printf("Bad input\n");
+        return 1;
+    }
+
+    if (cores != NULL) {
+        for (int k = 0; k < cache_count; k++) {
+            Cache *c = &caches[k];
+            printf("core:%d hits:%" PRIu64 " misses:%" PRIu64 " evictions:%" PRIu64
+                   " coherence_misses:%" PRIu64 " invalidations:%" PRIu64
+                   " interventions:%" PRIu64 " upgrades:%" PRIu64 " writebacks:%" PRIu64 "\n",
+                   k, c->hits, c->misses, c->evictions, c->coherence_misses,
+                   c->invalidations, c->interventions, c->upgrades, c->writebacks);
+        }
+        free(cores);
+    }
+    else if (mrc) {
+        for (int k = 0; k < cache_count; k++) {
+            Cache *c = &caches[k];
+            for (int lines = 1; lines <= c->lines_per_set; lines++) {
+                uint64_t h, m, e;
+                stack_counters(c, lines, &h, &m, &e);
+                printf("s:%d E:%d b:%d hits:%" PRIu64 " misses:%" PRIu64
+                       " evictions:%" PRIu64 " miss_ratio:%.6f\n",
+                       c->set_bit_count, lines, c->offset_bit_count, h, m, e,
+                       h + m ? (double) m / (h + m) : 0.0);
+            }
+        }
+    }
+    else if (hierarchical) {
+        Cache *levels[] = {hierarchy.l1i, hierarchy.l1d, hierarchy.lower[0], hierarchy.lower[1]};
+        const char *names[] = {"L1I", "L1D", "L2", "LLC"};
+        if (hierarchy.lower_count == 1 && level_specs[1] == NULL) {
+            // Only an LLC was given
+            levels[3] = levels[2];
+            levels[2] = NULL;
+        }
+        for (int k = 0; k < 4; k++) {
+            Cache *c = levels[k];
+            if (c != NULL) {
+                printf("%s hits:%" PRIu64 " misses:%" PRIu64 " evictions:%" PRIu64
+                       " invalidations:%" PRIu64 "\n",
+                       names[k], c->hits, c->misses, c->evictions, c->invalidations);
+            }
+        }
+    }
+    else if (base.sample_period > 1) {
+        for (int k = 0; k < cache_count; k++) {
+            Cache *c = &caches[k];
+            double estimates[3];
+            double intervals[3];
+            for (int counter = 0; counter < 3; counter++) {
+                estimates[counter] = sample_estimate(c, counter, &intervals[counter]);
+            }
+            if (sweep != NULL) {
+                printf("s:%d E:%d b:%d ", c->set_bit_count, c->lines_per_set,
+                       c->offset_bit_count);
+            }
+            printf("hits:%.0f+-%.0f misses:%.0f+-%.0f evictions:%.0f+-%.0f"
+                   " sampled_sets:%" PRIu64 "/%" PRIu64 "\n",
+                   estimates[0], intervals[0], estimates[1], intervals[1],
+                   estimates[2], intervals[2], c->sampled_set_count, c->set_count);
+        }
+    }
+    else if (sweep == NULL) {
+        // printSummary(hits, misses, evictions);
+        printf("hits:%" PRIu64 " misses:%" PRIu64 " evictions:%" PRIu64 "\n",
+               base.hits, base.misses, base.evictions);
+    }
+    else {
+        for (int k = 0; k < cache_count; k++) {
+            Cache *c = &caches[k];
+            printf("s:%d E:%d b:%d hits:%" PRIu64 " misses:%" PRIu64
+                   " evictions:%" PRIu64 "\n",
+                   c->set_bit_count, c->lines_per_set, c->offset_bit_count,
+                   c->hits, c->misses, c->evictions);
+        }
+    }
+    for (int k = 0; k < cache_count && base.breakdown; k++) {
+        print_breakdown(&caches[k], sweep != NULL);
+    }
+    for (int k = 0; k < cache_count && base.prefetchers; k++) {
+        print_prefetchers(&caches[k], sweep != NULL);
+    }
+    for (int k = 0; k < cache_count && base.write_mode; k++) {
+        Cache *c = &caches[k];
+        if (sweep != NULL) {
+            printf("s:%d E:%d b:%d ", c->set_bit_count, c->lines_per_set, c->offset_bit_count);
+        }
+        printf("memory dirty_evictions:%" PRIu64 " read_bytes:%" PRIu64
+               " write_bytes:%" PRIu64 "\n", c->dirty_evictions, c->read_bytes, c->write_bytes);
+    }
+    for (int k = 0; k < cache_count; k++) {
+        cleanup(&caches[k]);
+    }
+    if (caches != &base) {
+        free(caches);
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * Returns 1 if the geometry or engine of c cannot be simulated. A single set
+ * (no set index bits) cannot run on soa, whose SOA_HOLE needs one.
+ */
+static int check_config(const Cache *c)
+{
+    if (c->set_bit_count < 0 || c->lines_per_set <= 0 || c->offset_bit_count <= 0) {
+        return 1;
+    }
+    if (c->set_bit_count == 0
+        && (c->engine == ENGINE_SOA || c->policy != POLICY_LRU || c->prefetchers
+            || c->write_mode || c->protocol)) {
+        return 1;
+    }
+    if (c->set_bit_count >= 64 || c->offset_bit_count >= 64) {
+        return 1;
+    }
+    if ((int) c->engine == -1
+        || (c->engine == ENGINE_SOA && c->lines_per_set > SOA_MAX_LINES)) {
+        return 1;
+    }
+    if (c->policy != POLICY_LRU
+        && ((int) c->policy == -1
+            || (c->engine != ENGINE_AUTO && c->engine != ENGINE_SOA)
+            || c->lines_per_set > SOA_MAX_LINES)) {
+        return 1;
+    }
+    if (c->policy == POLICY_PLRU && (c->lines_per_set & (c->lines_per_set - 1)) != 0) {
+        return 1;
+    }
+    if ((c->prefetchers || c->write_mode || c->protocol)
+        && ((c->engine != ENGINE_AUTO && c->engine != ENGINE_SOA)
+            || c->lines_per_set > SOA_MAX_LINES)) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the Engine called name, or -1 if there is none.
+ */
+static Engine parse_engine(const char *name)
+{
+    static const struct {
+        const char *name;
+        Engine engine;
+    } engines[] = {
+        {"list", ENGINE_LIST},
+        {"hash", ENGINE_HASH},
+        {"soa", ENGINE_SOA},
+        {"stack", ENGINE_STACK},
+        {"auto", ENGINE_AUTO},
+    };
+    for (size_t k = 0; k < sizeof(engines) / sizeof(engines[0]); k++) {
+        if (strcmp(name, engines[k].name) == 0) {
+            return engines[k].engine;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the Policy called name, or -1 if there is none.
+ */
+static Policy parse_policy(const char *name)
+{
+    static const char *const names[POLICY_COUNT] = {
+        "lru", "fifo", "random", "plru", "nru", "srrip", "brrip", "lfu",
+    };
+    for (int p = 0; p < POLICY_COUNT; p++) {
+        if (strcmp(name, names[p]) == 0) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Sets the sampling of c from a spec of the form K or K:hash. Returns 1 if
+ * spec is malformed.
+ */
+static int parse_sample(const char *spec, Cache *c)
+{
+    char *end;
+    long period = strtol(spec, &end, 10);
+    if (end == spec || period < 1 || (*end != '\0' && strcmp(end, ":hash") != 0)) {
+        return 1;
+    }
+    c->sample_period = period;
+    c->sample_hashed = *end != '\0';
+    return 0;
+}
+
+/*
+ * Sets the geometry of c from a spec of the form s:E:b. Returns 1 if spec is
+ * malformed.
+ */
+static int parse_geometry(const char *spec, Cache *c)
+{
+    char extra;
+    if (sscanf(spec, "%d:%d:%d%c", &c->set_bit_count, &c->lines_per_set,
+               &c->offset_bit_count, &extra) != 3) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * A sweep spec is a comma-separated list of entries of the form s:E:b. Each
+ * field is a single value, an inclusive range lo-hi, or several of either
+ * separated by '/', and an entry stands for every combination of its fields.
+ * For example "4:1/2/4:4,1-3:8:5" is (4,1,4), (4,2,4), (4,4,4), (1,8,5),
+ * (2,8,5), and (3,8,5).
+ *
+ * On success, stores a newly allocated array of Caches copied from base (so
+ * they share its engine) and returns 0. spec is modified.
+ */
+static int parse_sweep(char *spec, const Cache *base, Cache **caches, int *cache_count)
+{
+    *caches = malloc(sizeof(Cache) * MAX_SWEEP_CACHES);
+    *cache_count = 0;
+    if (*caches == NULL) {
+        return 1;
+    }
+    char *entry_save;
+    for (char *entry = strtok_r(spec, ",", &entry_save); entry != NULL;
+         entry = strtok_r(NULL, ",", &entry_save)) {
+        char *fields[3];
+        fields[0] = entry;
+        fields[1] = strchr(fields[0], ':');
+        fields[2] = fields[1] ? strchr(fields[1] + 1, ':') : NULL;
+        if (fields[2] == NULL || strchr(fields[2] + 1, ':') != NULL) {
+            free(*caches);
+            return 1;
+        }
+        *fields[1]++ = '\0';
+        *fields[2]++ = '\0';
+
+        int values[3][MAX_SWEEP_VALUES];
+        int counts[3];
+        for (int f = 0; f < 3; f++) {
+            counts[f] = parse_sweep_field(fields[f], values[f], MAX_SWEEP_VALUES);
+            if (counts[f] <= 0) {
+                free(*caches);
+                return 1;
+            }
+        }
+        for (int i = 0; i < counts[0]; i++) {
+            for (int j = 0; j < counts[1]; j++) {
+                for (int k = 0; k < counts[2]; k++) {
+                    if (*cache_count == MAX_SWEEP_CACHES) {
+                        free(*caches);
+                        return 1;
+                    }
+                    Cache *c = &(*caches)[(*cache_count)++];
+                    *c = *base;
+                    c->set_bit_count = values[0][i];
+                    c->lines_per_set = values[1][j];
+                    c->offset_bit_count = values[2][k];
+                    if (check_config(c) == 1) {
+                        free(*caches);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    if (*cache_count == 0) {
+        free(*caches);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Expands one field of a sweep entry into values. Returns the number of
+ * values, or -1 if the field is malformed or has more than capacity values.
+ */
+static int parse_sweep_field(char *field, int *values, int capacity)
+{
+    int count = 0;
+    char *save;
+    for (char *item = strtok_r(field, "/", &save); item != NULL;
+         item = strtok_r(NULL, "/", &save)) {
+        char *end;
+        long lo = strtol(item, &end, 10);
+        long hi = lo;
+        if (*end == '-') {
+            hi = strtol(end + 1, &end, 10);
+        }
+        if (end == item || *end != '\0' || lo > hi || hi > INT32_MAX) {
+            return -1;
+        }
+        for (long v = lo; v <= hi; v++) {
+            if (count == capacity) {
+                return -1;
+            }
+            values[count++] = v;
+        }
+    }
+    return count;
+}
+#endif
+
+static int initialize(Cache *c)
+{
+    // Guaranteed no overflow
+    c->set_count = (uint64_t) 1 << c->set_bit_count;
+    if (c->sample_period > 1 && initialize_sample(c) == 1) {
+        return 1;
+    }
+    if (c->breakdown && initialize_breakdown(c) == 1) {
+        return 1;
+    }
+    if (c->dedup) {
+        c->last_tag = sparse_calloc(c->set_count, sizeof(uint64_t));
+        if (c->last_tag == NULL) {
+            return 1;
+        }
+    }
+    if (c->engine == ENGINE_AUTO
+        && (c->policy != POLICY_LRU || c->prefetchers || c->write_mode || c->protocol)) {
+        c->engine = ENGINE_SOA;
+    }
+    if (c->write_mode && (c->dirty = sparse_calloc(c->set_count, sizeof(uint64_t))) == NULL) {
+        return 1;
+    }
+    if (c->prefetchers && initialize_prefetchers(c) == 1) {
+        return 1;
+    }
+    if (c->engine == ENGINE_AUTO) {
+        c->engine = c->lines_per_set >= HASH_MIN_LINES ? ENGINE_HASH : ENGINE_LIST;
+    }
+    if (c->engine == ENGINE_SOA) {
+        return initialize_soa(c) == 1 || (c->protocol && initialize_coherence(c) == 1);
+    }
+    if (c->engine == ENGINE_STACK) {
+        return initialize_stack(c);
+    }
+    uint64_t set_count = c->set_count;
+    uint64_t bytes_to_allocate = sizeof(CacheSet) * set_count;
+    if (bytes_to_allocate / set_count != sizeof(CacheSet)) {
+        return 1; // Overflow
+    }
+    c->sets = sparse_calloc(set_count, sizeof(CacheSet));
+    if (c->sets == NULL) {
+        return 1;
+    }
+
+    uint64_t line_count = set_count * c->lines_per_set;
+    if (line_count / set_count != (uint64_t) c->lines_per_set) {
+        sparse_free(c->sets);
+        return 1; // Overflow
+    }
+    bytes_to_allocate = sizeof(CacheLine) * line_count;
+    if (bytes_to_allocate / line_count != sizeof(CacheLine)) {
+        sparse_free(c->sets);
+        return 1; // Overflow
+    }
+    c->line_arena = sparse_calloc(line_count, sizeof(CacheLine));
+    if (c->line_arena == NULL) {
+        sparse_free(c->sets);
+        return 1;
+    }
+    if (c->engine == ENGINE_HASH && initialize_hash(c) == 1) {
+        sparse_free(c->line_arena);
+        sparse_free(c->sets);
+        return 1;
+    }
+    return 0;
+}
+
+static int initialize_hash(Cache *c)
+{
+    c->hash_capacity = 2;
+    c->hash_shift = 63;
+    while (c->hash_capacity < 2 * (uint64_t) c->lines_per_set) {
+        c->hash_capacity <<= 1;
+        c->hash_shift--;
+    }
+    uint64_t slot_count = c->set_count * c->hash_capacity;
+    if (slot_count / c->set_count != c->hash_capacity
+        || slot_count * sizeof(uint32_t) / sizeof(uint32_t) != slot_count) {
+        return 1; // Overflow
+    }
+    c->hash_index = sparse_calloc(slot_count, sizeof(uint32_t));
+    return c->hash_index == NULL;
+}
+
+static int initialize_soa(Cache *c)
+{
+    c->soa_stride = ((uint64_t) c->lines_per_set + 7) & ~(uint64_t) 7;
+    uint64_t way_count = c->set_count * c->soa_stride;
+    if (way_count / c->set_count != c->soa_stride
+        || way_count * sizeof(uint64_t) / sizeof(uint64_t) != way_count) {
+        return 1; // Overflow
+    }
+    c->soa_tags = sparse_calloc(way_count, sizeof(uint64_t));
+    c->soa_age = sparse_calloc(way_count, 1);
+    c->soa_size = sparse_calloc(c->set_count, 1);
+    c->policy_state = sparse_calloc(c->set_count, sizeof(uint64_t));
+    if (c->soa_tags == NULL || c->soa_age == NULL || c->soa_size == NULL
+        || c->policy_state == NULL) {
+        sparse_free(c->soa_tags);
+        sparse_free(c->soa_age);
+        sparse_free(c->soa_size);
+        sparse_free(c->policy_state);
+        return 1;
+    }
+    return 0;
+}
+
+static int initialize_stack(Cache *c)
+{
+    uint64_t node_count = c->set_count * c->lines_per_set;
+    if (node_count / c->set_count != (uint64_t) c->lines_per_set
+        || node_count * sizeof(StackNode) / sizeof(StackNode) != node_count) {
+        return 1; // Overflow
+    }
+    c->stack_nodes = sparse_calloc(node_count, sizeof(StackNode));
+    c->stack_root = sparse_calloc(c->set_count, sizeof(uint32_t));
+    c->stack_distance_count = calloc(c->lines_per_set, sizeof(uint64_t));
+    c->stack_fill_count = calloc(c->lines_per_set + 1, sizeof(uint64_t));
+    c->stack_seed = 0x2545f4914f6cdd1d;
+    if (c->stack_nodes == NULL || c->stack_root == NULL
+        || c->stack_distance_count == NULL || c->stack_fill_count == NULL
+        || initialize_hash(c) == 1) {
+        sparse_free(c->stack_nodes);
+        sparse_free(c->stack_root);
+        free(c->stack_distance_count);
+        free(c->stack_fill_count);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Picks the sampled sets of c. Fails if there are none.
+ */
+static int initialize_sample(Cache *c)
+{
+    c->sample_group = malloc(c->set_count);
+    c->sample_groups = calloc(SAMPLE_GROUPS, sizeof(Counters));
+    if (c->sample_group == NULL || c->sample_groups == NULL) {
+        return 1;
+    }
+    c->sampled_set_count = 0;
+    for (uint64_t i = 0; i < c->set_count; i++) {
+        uint64_t key = c->sample_hashed ? (i * 0x9e3779b97f4a7c15) >> 32 : i;
+        if (key % c->sample_period == 0) {
+            c->sample_group[i] = 1 + c->sampled_set_count++ % SAMPLE_GROUPS;
+        }
+        else {
+            c->sample_group[i] = 0;
+        }
+    }
+    return c->sampled_set_count == 0;
+}
+
+/*
+ * Allocates the counters of the breakdowns of c and, for the miss
+ * classification, its shadow cache: one set of every line of c, under the
+ * hash engine.
+ */
+static int initialize_breakdown(Cache *c)
+{
+    if (c->breakdown & BREAKDOWN_SETS) {
+        c->set_counters = sparse_calloc(c->set_count, sizeof(Counters));
+        if (c->set_counters == NULL) {
+            return 1;
+        }
+    }
+    if (c->breakdown & BREAKDOWN_MISSES) {
+        uint64_t line_count = c->set_count * c->lines_per_set;
+        if (line_count / c->set_count != (uint64_t) c->lines_per_set || line_count > INT32_MAX) {
+            return 1;
+        }
+        c->shadow = calloc(1, sizeof(Cache));
+        c->seen = calloc(1, sizeof(BlockSet));
+        if (c->shadow == NULL || c->seen == NULL) {
+            return 1;
+        }
+        c->shadow->lines_per_set = line_count;
+        c->shadow->offset_bit_count = c->offset_bit_count;
+        c->shadow->engine = ENGINE_HASH;
+        c->seen->capacity = 1024;
+        c->seen->slots = calloc(c->seen->capacity, sizeof(uint64_t));
+        if (c->seen->slots == NULL || initialize(c->shadow) == 1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Returns the BREAKDOWN_ flags named in the comma-separated spec, or -1 if it
+ * names anything else. spec is modified.
+ */
+static int parse_breakdown(char *spec)
+{
+    int breakdown = 0;
+    char *save;
+    for (char *item = strtok_r(spec, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        if (strcmp(item, "ops") == 0) {
+            breakdown |= BREAKDOWN_OPS;
+        }
+        else if (strcmp(item, "sets") == 0) {
+            breakdown |= BREAKDOWN_SETS;
+        }
+        else if (strcmp(item, "misses") == 0) {
+            breakdown |= BREAKDOWN_MISSES;
+        }
+        else {
+            return -1;
+        }
+    }
+    return breakdown ? breakdown : -1;
+}
+
+/*
+ * Returns the PREFETCH_ flags named in the comma-separated spec, or -1 if it
+ * names anything else. spec is modified.
+ */
+static int parse_prefetchers(char *spec)
+{
+    int prefetchers = 0;
+    char *save;
+    for (char *item = strtok_r(spec, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        if (strcmp(item, "next-line") == 0) {
+            prefetchers |= PREFETCH_NEXT_LINE;
+        }
+        else if (strcmp(item, "stride") == 0) {
+            prefetchers |= PREFETCH_STRIDE;
+        }
+        else if (strcmp(item, "stream") == 0) {
+            prefetchers |= PREFETCH_STREAM;
+        }
+        else {
+            return -1;
+        }
+    }
+    return prefetchers ? prefetchers : -1;
+}
+#endif
+
+static int initialize_prefetchers(Cache *c)
+{
+    c->prefetcher = calloc(1, sizeof(Prefetcher));
+    c->prefetched = sparse_calloc(c->set_count, sizeof(uint64_t));
+    if (c->prefetcher == NULL || c->prefetched == NULL) {
+        return 1;
+    }
+    for (int k = 0; k < STRIDE_TABLE_SIZE; k++) {
+        c->prefetcher->strides[k].region = UINT64_MAX;
+    }
+    return 0;
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Returns the WRITE_ flags of a spec of the form back or through, optionally
+ * followed by ,allocate or ,no-allocate, or -1 if spec is malformed. spec is
+ * modified.
+ */
+static int parse_write_mode(char *spec)
+{
+    char *save;
+    char *policy = strtok_r(spec, ",", &save);
+    char *allocate = strtok_r(NULL, ",", &save);
+    int mode;
+    if (policy != NULL && strcmp(policy, "back") == 0) {
+        mode = WRITE_BACK;
+    }
+    else if (policy != NULL && strcmp(policy, "through") == 0) {
+        mode = WRITE_THROUGH | WRITE_NO_ALLOCATE;
+    }
+    else {
+        return -1;
+    }
+    if (allocate != NULL && strcmp(allocate, "allocate") == 0) {
+        mode &= ~WRITE_NO_ALLOCATE;
+    }
+    else if (allocate != NULL && strcmp(allocate, "no-allocate") == 0) {
+        mode |= WRITE_NO_ALLOCATE;
+    }
+    else if (allocate != NULL) {
+        return -1;
+    }
+    return strtok_r(NULL, ",", &save) == NULL ? mode : -1;
+}
+
+/*
+ * Prints the prefetch counters of c, prefixed by its geometry if it is one of
+ * a sweep.
+ */
+static void print_prefetchers(const Cache *c, int sweep)
+{
+    const Prefetcher *p = c->prefetcher;
+    if (sweep) {
+        printf("s:%d E:%d b:%d ", c->set_bit_count, c->lines_per_set, c->offset_bit_count);
+    }
+    printf("prefetch fills:%" PRIu64 " hits:%" PRIu64 " useless:%" PRIu64
+           " evictions:%" PRIu64 "\n", p->fills, p->hits, p->useless, p->evictions);
+}
+
+/*
+ * Prints the breakdowns of c, one line each, prefixed by its geometry if it is
+ * one of a sweep.
+ */
+static void print_breakdown(const Cache *c, int sweep)
+{
+    char prefix[64] = "";
+    if (sweep) {
+        snprintf(prefix, sizeof(prefix), "s:%d E:%d b:%d ", c->set_bit_count,
+                 c->lines_per_set, c->offset_bit_count);
+    }
+    if (c->breakdown & BREAKDOWN_OPS) {
+        for (int k = 0; k < 3; k++) {
+            const Counters *n = &c->op_counters[k];
+            printf("%sop:%c hits:%" PRIu64 " misses:%" PRIu64 " evictions:%" PRIu64 "\n",
+                   prefix, "LSM"[k], n->hits, n->misses, n->evictions);
+        }
+    }
+    if (c->breakdown & BREAKDOWN_MISSES) {
+        printf("%scold:%" PRIu64 " capacity:%" PRIu64 " conflict:%" PRIu64 "\n",
+               prefix, c->cold_misses, c->capacity_misses, c->conflict_misses);
+    }
+    if (c->breakdown & BREAKDOWN_SETS) {
+        for (uint64_t i = 0; i < c->set_count; i++) {
+            const Counters *n = &c->set_counters[i];
+            printf("%sset:%" PRIu64 " hits:%" PRIu64 " misses:%" PRIu64
+                   " evictions:%" PRIu64 "\n",
+                   prefix, i, n->hits, n->misses, n->evictions);
+        }
+    }
+}
+#endif
+
+static void cleanup(Cache *c)
+{
+    sparse_free(c->line_arena);
+    sparse_free(c->sets);
+    sparse_free(c->hash_index);
+    sparse_free(c->soa_tags);
+    sparse_free(c->soa_age);
+    sparse_free(c->soa_size);
+    sparse_free(c->policy_state);
+    free(c->sample_group);
+    free(c->sample_groups);
+    sparse_free(c->set_counters);
+    if (c->shadow != NULL) {
+        cleanup(c->shadow);
+        free(c->shadow);
+    }
+    if (c->seen != NULL) {
+        free(c->seen->slots);
+        free(c->seen);
+    }
+    sparse_free(c->stack_nodes);
+    sparse_free(c->stack_root);
+    free(c->stack_distance_count);
+    free(c->stack_fill_count);
+    sparse_free(c->last_tag);
+    free(c->prefetcher);
+    sparse_free(c->prefetched);
+    sparse_free(c->dirty);
+    sparse_free(c->coherence);
+    sparse_free(c->lost_tags);
+}
+
+/*
+ * Returns a zeroed, 64-byte aligned array of count elements of size bytes,
+ * to be freed with sparse_free, or NULL on failure.
+ */
+static void *sparse_calloc(uint64_t count, size_t size)
+{
+    if (size != 0 && count > (SIZE_MAX - SPARSE_HEADER_BYTES) / size) {
+        return NULL; // Overflow
+    }
+    size_t bytes = SPARSE_HEADER_BYTES + count * size;
+    char *block;
+    if (bytes < SPARSE_MIN_BYTES) {
+        if (posix_memalign((void **) &block, 64, bytes) != 0) {
+            return NULL;
+        }
+        memset(block, 0, bytes);
+    }
+    else {
+        block = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (block == MAP_FAILED) {
+            return NULL;
+        }
+    }
+    *(size_t *) block = bytes;
+    return block + SPARSE_HEADER_BYTES;
+}
+
+static void sparse_free(void *block)
+{
+    if (block == NULL) {
+        return;
+    }
+    char *start = (char *) block - SPARSE_HEADER_BYTES;
+    size_t bytes = *(size_t *) start;
+    if (bytes < SPARSE_MIN_BYTES) {
+        free(start);
+    }
+    else {
+        munmap(start, bytes);
+    }
+}
+
+static int initialize_coherence(Cache *c)
+{
+    c->coherence = sparse_calloc(c->set_count * c->soa_stride, 1);
+    c->lost_tags = sparse_calloc(c->set_count * c->soa_stride, sizeof(uint64_t));
+    return c->coherence == NULL || c->lost_tags == NULL;
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Zeroes the counters of c, for a worker's copy of a cache.
+ */
+static void clear_counters(Cache *c)
+{
+    c->hits = 0;
+    c->misses = 0;
+    c->evictions = 0;
+    c->invalidations = 0;
+    c->find_probes = 0;
+    c->dedup_hits = 0;
+    c->dirty_evictions = 0;
+    c->read_bytes = 0;
+    c->write_bytes = 0;
+    c->coherence_misses = 0;
+    c->interventions = 0;
+    c->upgrades = 0;
+    c->writebacks = 0;
+    memset(c->op_counters, 0, sizeof(c->op_counters));
+}
+
+/*
+ * Zeroes every counter of c, those of the sample groups, breakdowns, stack
+ * distances, prefetchers, and dedup included, at the end of a --warmup.
+ */
+static void reset_counters(Cache *c)
+{
+    clear_counters(c);
+    if (c->sample_groups != NULL) {
+        memset(c->sample_groups, 0, SAMPLE_GROUPS * sizeof(Counters));
+    }
+    if (c->set_counters != NULL) {
+        memset(c->set_counters, 0, c->set_count * sizeof(Counters));
+    }
+    c->cold_misses = 0;
+    c->capacity_misses = 0;
+    c->conflict_misses = 0;
+    if (c->stack_distance_count != NULL) {
+        memset(c->stack_distance_count, 0, c->lines_per_set * sizeof(uint64_t));
+        memset(c->stack_fill_count, 0, (c->lines_per_set + 1) * sizeof(uint64_t));
+    }
+    if (c->prefetcher != NULL) {
+        c->prefetcher->fills = 0;
+        c->prefetcher->hits = 0;
+        c->prefetcher->useless = 0;
+        c->prefetcher->evictions = 0;
+    }
+}
+
+/*
+ * Adds the counters of a worker's copy of a cache to the cache.
+ */
+static void add_counters(Cache *to, const Cache *from)
+{
+    to->hits += from->hits;
+    to->misses += from->misses;
+    to->evictions += from->evictions;
+    to->invalidations += from->invalidations;
+    to->find_probes += from->find_probes;
+    to->dedup_hits += from->dedup_hits;
+    to->dirty_evictions += from->dirty_evictions;
+    to->read_bytes += from->read_bytes;
+    to->write_bytes += from->write_bytes;
+    to->coherence_misses += from->coherence_misses;
+    to->interventions += from->interventions;
+    to->upgrades += from->upgrades;
+    to->writebacks += from->writebacks;
+    for (int op = 0; op < 3; op++) {
+        to->op_counters[op].hits += from->op_counters[op].hits;
+        to->op_counters[op].misses += from->op_counters[op].misses;
+        to->op_counters[op].evictions += from->op_counters[op].evictions;
+    }
+}
+
+/*
+ * Starts the worker threads of sim, if it has more than one. The workers
+ * never outnumber the sets.
+ */
+static int start_workers(Simulation *sim)
+{
+    Cache *c = &sim->caches[0];
+    if ((uint64_t) sim->worker_count > c->set_count) {
+        sim->worker_count = c->set_count;
+    }
+    if (sim->worker_count == 1) {
+        return 0;
+    }
+    sim->workers = calloc(sim->worker_count, sizeof(Worker));
+    if (sim->workers == NULL) {
+        return 1;
+    }
+    for (int k = 0; k < sim->worker_count; k++) {
+        Worker *w = &sim->workers[k];
+        w->cache = *c;
+        clear_counters(&w->cache);
+        if (c->protocol) {
+            w->core_count = sim->cache_count;
+            w->cores = malloc(sizeof(Cache) * w->core_count);
+            if (w->cores == NULL) {
+                return 1;
+            }
+            for (int j = 0; j < w->core_count; j++) {
+                w->cores[j] = sim->caches[j];
+                clear_counters(&w->cores[j]);
+            }
+        }
+        if (c->engine == ENGINE_STACK) {
+            w->cache.stack_distance_count = calloc(c->lines_per_set, sizeof(uint64_t));
+            w->cache.stack_fill_count = calloc(c->lines_per_set + 1, sizeof(uint64_t));
+            if (w->cache.stack_distance_count == NULL || w->cache.stack_fill_count == NULL) {
+                return 1;
+            }
+        }
+        w->ring = malloc(sizeof(TraceBatch) * RING_BATCHES);
+        if (w->ring == NULL) {
+            return 1;
+        }
+        w->ring[0].count = 0;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->changed, NULL);
+        if (pthread_create(&w->thread, NULL, run_worker, w) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Hands the remaining records to the workers, waits for them, and adds their
+ * counters to the cache.
+ */
+static void finish_workers(Simulation *sim)
+{
+    if (sim->workers == NULL) {
+        return;
+    }
+    Cache *c = &sim->caches[0];
+    for (int k = 0; k < sim->worker_count; k++) {
+        Worker *w = &sim->workers[k];
+        if (w->ring[w->head % RING_BATCHES].count > 0) {
+            publish_batch(w);
+        }
+        __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+        wake_ring(w);
+    }
+    for (int k = 0; k < sim->worker_count; k++) {
+        Worker *w = &sim->workers[k];
+        pthread_join(w->thread, NULL);
+        if (w->cores != NULL) {
+            for (int j = 0; j < w->core_count; j++) {
+                add_counters(&sim->caches[j], &w->cores[j]);
+            }
+            free(w->cores);
+        }
+        else {
+            add_counters(c, &w->cache);
+        }
+        if (c->engine == ENGINE_STACK) {
+            for (int d = 0; d < c->lines_per_set; d++) {
+                c->stack_distance_count[d] += w->cache.stack_distance_count[d];
+            }
+            for (int n = 0; n <= c->lines_per_set; n++) {
+                c->stack_fill_count[n] += w->cache.stack_fill_count[n];
+            }
+            free(w->cache.stack_distance_count);
+            free(w->cache.stack_fill_count);
+        }
+        free(w->ring);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->changed);
+    }
+    free(sim->workers);
+    sim->workers = NULL;
+}
+
+static void *run_worker(void *arg)
+{
+    Worker *w = arg;
+    while (1) {
+        int done = __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+        if (w->tail < head && w->cores != NULL) {
+            coherence_batch(w->cores, w->core_count, &w->ring[w->tail % RING_BATCHES]);
+            __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+            wake_ring(w);
+        }
+        else if (w->tail < head) {
+            simulate_batch(&w->cache, &w->ring[w->tail % RING_BATCHES]);
+            __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+            wake_ring(w);
+        }
+        else if (done) {
+            return NULL;
+        }
+        else {
+            wait_ring(w, 0);
+        }
+    }
+}
+
+/*
+ * Publishes the batch w is currently being given and waits until the next
+ * ring slot is free. Called only by the reader thread.
+ */
+static void publish_batch(Worker *w)
+{
+    uint64_t head = w->head + 1;
+    __atomic_store_n(&w->head, head, __ATOMIC_RELEASE);
+    wake_ring(w);
+    wait_ring(w, 1);
+    w->ring[head % RING_BATCHES].count = 0;
+}
+
+/*
+ * Hands the workers the records they are still being given and waits until
+ * they have simulated all of them, so that the sets are up to date.
+ */
+static void drain_workers(Simulation *sim)
+{
+    for (int k = 0; k < sim->worker_count; k++) {
+        Worker *w = &sim->workers[k];
+        if (w->ring[w->head % RING_BATCHES].count > 0) {
+            publish_batch(w);
+        }
+        wait_ring(w, RING_BATCHES);
+    }
+}
+
+/*
+ * Returns whether the writer of w has free_slots ring slots free (RING_BATCHES
+ * once the worker has simulated everything), or if free_slots is 0, whether
+ * its reader has a batch to take or will get no more.
+ */
+static int ring_ready(Worker *w, int free_slots)
+{
+    if (free_slots > 0) {
+        return w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE)
+               <= (uint64_t) (RING_BATCHES - free_slots);
+    }
+    return w->tail < __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Waits until ring_ready(w, free_slots), yielding for RING_SPINS tries before
+ * going to sleep. sleepers is raised before the last check under lock, so
+ * a wake_ring after it cannot miss the sleeper.
+ */
+static void wait_ring(Worker *w, int free_slots)
+{
+    for (int spin = 0; !ring_ready(w, free_slots); spin++) {
+        if (spin < RING_SPINS) {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&w->lock);
+        __atomic_add_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (!ring_ready(w, free_slots)) {
+            pthread_cond_wait(&w->changed, &w->lock);
+        }
+        __atomic_sub_fetch(&w->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/*
+ * Wakes any thread asleep on w after its caller has moved head, tail, or done.
+ */
+static void wake_ring(Worker *w)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->sleepers, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_broadcast(&w->changed);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Feeds batch to sim. A batch that reaches the end of an --interval or the
+ * next --checkpoint is fed in pieces, with a row or checkpoint written after
+ * the piece that ends there. The records a resumed run skips are dropped.
+ */
+static void consume_batch(Simulation *sim, const TraceBatch *batch)
+{
+    sim->batch_trace_records = sim->trace_records;
+    if (sim->filter != NULL) {
+        batch = filter_batch(sim, batch);
+    }
+    if (sim->interval == 0 && sim->checkpoint_path == NULL && sim->skip_records == 0
+        && sim->cold_count == 0) {
+        time_batch(sim, batch);
+        return;
+    }
+    size_t start = 0;
+    if (sim->skip_records > 0) {
+        start = batch->count < sim->skip_records ? batch->count : sim->skip_records;
+        sim->skip_records -= start;
+    }
+    sim->batch_done = start;
+    while (start < batch->count) {
+        uint64_t n = batch->count - start;
+        if (sim->interval > 0) {
+            n = n < sim->interval_left ? n : sim->interval_left;
+        }
+        if (sim->checkpoint_path != NULL && sim->next_checkpoint - sim->record_count < n) {
+            n = sim->next_checkpoint - sim->record_count;
+        }
+        for (int k = 0; k < sim->cache_count && sim->cold_count > 0; k++) {
+            // A record fills at most one line, so none can fill up early
+            uint64_t left = sim->warmup_full ? fills_left(&sim->caches[k])
+                            : sim->warmup - sim->record_count;
+            if (sim->cold[k] && left < n) {
+                n = left;
+            }
+        }
+        time_batch(sim, slice(sim, batch, start, n));
+        start += n;
+        sim->batch_done = start;
+        if (sim->cold_count > 0) {
+            end_warmup(sim);
+        }
+        if (sim->interval > 0 && (sim->interval_left -= n) == 0) {
+            write_interval(sim);
+            sim->interval_left = sim->interval;
+        }
+        if (sim->checkpoint_path != NULL && sim->record_count == sim->next_checkpoint) {
+            if (sim->workers != NULL) {
+                drain_workers(sim);
+            }
+            sim->checkpoint_error |= write_checkpoint(sim, sim->checkpoint_path);
+            sim->next_checkpoint += sim->checkpoint_period;
+        }
+    }
+}
+
+/*
+ * Returns the records of batch that the filter of sim keeps, copied into its
+ * filter_batch, and counts the records of batch as decoded.
+ */
+static const TraceBatch *filter_batch(Simulation *sim, const TraceBatch *batch)
+{
+    const Filter *f = sim->filter;
+    TraceBatch *out = sim->filter_batch;
+    uint64_t first = sim->trace_records;
+    sim->trace_records += batch->count;
+    size_t start = 0;
+    size_t stop = batch->count;
+    if (first < f->skip) {
+        start = f->skip - first < stop ? f->skip - first : stop;
+    }
+    if (f->limit > 0 && f->skip + f->limit <= sim->trace_records) {
+        stop = f->skip + f->limit > first ? f->skip + f->limit - first : 0;
+        sim->limit_reached = 1;
+    }
+    out->count = 0;
+    for (size_t k = start; k < stop; k++) {
+        uint64_t address = batch->address[k];
+        if (!f->keep_op[(uint8_t) batch->op[k]]) {
+            continue;
+        }
+        int in_range = f->range_count == 0;
+        for (int r = 0; r < f->range_count && !in_range; r++) {
+            in_range = address >= f->range_start[r] && address < f->range_end[r];
+        }
+        if (!in_range) {
+            continue;
+        }
+        size_t n = out->count++;
+        out->address[n] = address;
+        out->size[n] = batch->size[k];
+        out->op[n] = batch->op[k];
+        out->core[n] = batch->core[k];
+    }
+    return out;
+}
+
+/*
+ * Adds the comma-separated ranges lo-hi of spec, in hex, to filter. Returns 1
+ * if spec is malformed, a range is empty, or there are too many. spec is
+ * modified.
+ */
+static int parse_ranges(char *spec, Filter *filter)
+{
+    for (char *range = strtok(spec, ","); range != NULL; range = strtok(NULL, ",")) {
+        char *dash;
+        char *end;
+        uint64_t lo = strtoull(range, &dash, 16);
+        if (dash == range || *dash != '-' || filter->range_count == FILTER_MAX_RANGES) {
+            return 1;
+        }
+        uint64_t hi = strtoull(dash + 1, &end, 16);
+        if (end == dash + 1 || *end != '\0' || hi <= lo) {
+            return 1;
+        }
+        filter->range_start[filter->range_count] = lo;
+        filter->range_end[filter->range_count] = hi;
+        filter->range_count++;
+    }
+    return filter->range_count == 0;
+}
+
+/*
+ * Makes filter keep only the operations whose letters are in spec. Returns 1
+ * if spec is empty or has any other letter.
+ */
+static int parse_ops(const char *spec, Filter *filter)
+{
+    memset(filter->keep_op, 0, sizeof(filter->keep_op));
+    for (const char *p = spec; *p != '\0'; p++) {
+        if (*p != 'L' && *p != 'S' && *p != 'M' && *p != 'I') {
+            return 1;
+        }
+        filter->keep_op[(uint8_t) *p] = 1;
+    }
+    return *spec == '\0';
+}
+
+/*
+ * Returns the n records of batch from start on: batch itself if that is all
+ * of it, and otherwise a copy in the slice_batch of sim.
+ */
+static const TraceBatch *slice(Simulation *sim, const TraceBatch *batch, size_t start, size_t n)
+{
+    if (start == 0 && n == batch->count) {
+        return batch;
+    }
+    TraceBatch *piece = sim->slice_batch;
+    piece->count = n;
+    memcpy(piece->address, batch->address + start, n * sizeof(batch->address[0]));
+    memcpy(piece->size, batch->size + start, n * sizeof(batch->size[0]));
+    memcpy(piece->op, batch->op + start, n * sizeof(batch->op[0]));
+    memcpy(piece->core, batch->core + start, n * sizeof(batch->core[0]));
+    return piece;
+}
+
+/*
+ * Returns how many more lines c has to fill before every set it simulates is
+ * full. Every miss fills a line and every eviction empties one, as long as
+ * nothing else fills or invalidates lines.
+ */
+static uint64_t fills_left(const Cache *c)
+{
+    uint64_t sets = c->sample_group != NULL ? c->sampled_set_count : c->set_count;
+    return sets * c->lines_per_set - (c->misses - c->evictions);
+}
+
+/*
+ * Zeroes the counters of the caches of sim that are done warming up, and
+ * restarts their --interval rows from them.
+ */
+static void end_warmup(Simulation *sim)
+{
+    for (int k = 0; k < sim->cache_count; k++) {
+        Cache *c = &sim->caches[k];
+        if (!sim->cold[k]
+            || (sim->warmup_full ? fills_left(c) > 0 : sim->record_count < sim->warmup)) {
+            continue;
+        }
+        reset_counters(c);
+        if (sim->interval_last != NULL) {
+            memset(&sim->interval_last[k], 0, sizeof(Counters));
+        }
+        sim->cold[k] = 0;
+        sim->cold_count--;
+    }
+}
+
+/*
+ * Writes the checkpoint of sim to path, by way of a temporary file that then
+ * replaces path, so that a run killed while writing leaves the last
+ * checkpoint intact. Returns 1 on failure.
+ */
+static int write_checkpoint(const Simulation *sim, const char *path)
+{
+    size_t length = strlen(path);
+    char *temporary = malloc(length + 5);
+    if (temporary == NULL) {
+        return 1;
+    }
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", 5);
+    FILE *out = fopen(temporary, "wb");
+    if (out == NULL) {
+        free(temporary);
+        return 1;
+    }
+    CheckpointHeader header = {
+        CHECKPOINT_MAGIC, sim->record_count, sim->batch_offset, sim->batch_done,
+        sim->batch_trace_records, sim->cache_count, 0,
+    };
+    int status = fwrite(&header, sizeof(header), 1, out) != 1;
+    for (int k = 0; k < sim->cache_count && status == 0; k++) {
+        const Cache *c = &sim->caches[k];
+        // Workers split a single cache, which they share the sets of
+        Cache total = *c;
+        for (int w = 0; sim->workers != NULL && w < sim->worker_count; w++) {
+            add_counters(&total, &sim->workers[w].cache);
+        }
+        CacheSnapshot snapshot = {
+            c->set_bit_count, c->lines_per_set, c->offset_bit_count, c->engine, c->policy,
+            c->write_mode, total.hits, total.misses, total.evictions, total.find_probes,
+            total.dirty_evictions, total.read_bytes, total.write_bytes,
+        };
+        status = fwrite(&snapshot, sizeof(snapshot), 1, out) != 1;
+        if (c->engine == ENGINE_SOA) {
+            uint64_t ways = c->set_count * c->soa_stride;
+            status |= fwrite(c->soa_size, 1, c->set_count, out) != c->set_count;
+            status |= fwrite(c->soa_tags, sizeof(uint64_t), ways, out) != ways;
+            status |= fwrite(c->soa_age, 1, ways, out) != ways;
+            status |= fwrite(c->policy_state, sizeof(uint64_t), c->set_count, out) != c->set_count;
+            if (c->dirty != NULL) {
+                status |= fwrite(c->dirty, sizeof(uint64_t), c->set_count, out) != c->set_count;
+            }
+            continue;
+        }
+        for (uint64_t i = 0; i < c->set_count && status == 0; i++) {
+            uint32_t size = c->sets[i].size;
+            status = fwrite(&size, sizeof(size), 1, out) != 1;
+            for (const CacheLine *l = c->sets[i].lru; l != NULL && status == 0; l = l->next) {
+                status = fwrite(&l->tag, sizeof(l->tag), 1, out) != 1;
+            }
+        }
+    }
+    status |= fclose(out) != 0;
+    status = status || rename(temporary, path) != 0;
+    if (status) {
+        unlink(temporary);
+    }
+    free(temporary);
+    return status;
+}
+
+/*
+ * Restores the caches of sim, which must be the ones the checkpoint at path
+ * was written for, freshly initialized, and sets it to skip the records they
+ * already simulated, or to start where they stopped with resume_at. Returns 1
+ * if path cannot be read or does not fit.
+ */
+static int read_checkpoint(Simulation *sim, const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return 1;
+    }
+    CheckpointHeader header;
+    int status = fread(&header, sizeof(header), 1, in) != 1
+                 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0
+                 || header.cache_count != (uint32_t) sim->cache_count;
+    for (int k = 0; k < sim->cache_count && status == 0; k++) {
+        Cache *c = &sim->caches[k];
+        CacheSnapshot snapshot;
+        status = fread(&snapshot, sizeof(snapshot), 1, in) != 1
+                 || snapshot.set_bit_count != c->set_bit_count
+                 || snapshot.lines_per_set != c->lines_per_set
+                 || snapshot.offset_bit_count != c->offset_bit_count
+                 || snapshot.engine != (int32_t) c->engine || snapshot.policy != (int32_t) c->policy
+                 || snapshot.write_mode != c->write_mode;
+        if (status == 0 && c->engine == ENGINE_SOA) {
+            uint64_t ways = c->set_count * c->soa_stride;
+            status |= fread(c->soa_size, 1, c->set_count, in) != c->set_count;
+            status |= fread(c->soa_tags, sizeof(uint64_t), ways, in) != ways;
+            status |= fread(c->soa_age, 1, ways, in) != ways;
+            status |= fread(c->policy_state, sizeof(uint64_t), c->set_count, in) != c->set_count;
+            if (c->dirty != NULL) {
+                status |= fread(c->dirty, sizeof(uint64_t), c->set_count, in) != c->set_count;
+            }
+        }
+        for (uint64_t i = 0; i < c->set_count && status == 0 && c->engine != ENGINE_SOA; i++) {
+            uint32_t size;
+            status = fread(&size, sizeof(size), 1, in) != 1 || size > (uint32_t) c->lines_per_set;
+            for (uint32_t j = 0; j < size && status == 0; j++) {
+                uint64_t tag;
+                status = fread(&tag, sizeof(tag), 1, in) != 1;
+                simulate_access(c, 'L', (tag | i) << c->offset_bit_count);
+            }
+        }
+        c->hits = snapshot.hits;
+        c->misses = snapshot.misses;
+        c->evictions = snapshot.evictions;
+        c->find_probes = snapshot.find_probes;
+        c->dirty_evictions = snapshot.dirty_evictions;
+        c->read_bytes = snapshot.read_bytes;
+        c->write_bytes = snapshot.write_bytes;
+        if (c->last_tag != NULL) {
+            memset(c->last_tag, 0, c->set_count * sizeof(uint64_t));
+        }
+    }
+    fclose(in);
+    sim->record_count = header.record_count;
+    sim->skip_records = header.record_count;
+    sim->resume_offset = header.resume_offset;
+    sim->resume_skip = header.resume_skip;
+    sim->resume_trace_records = header.trace_records;
+    return status;
+}
+
+/*
+ * Returns the byte offset a reader that can seek starts the trace of sim at,
+ * and sets sim to skip only the records the checkpoint holds after it. Returns
+ * 0, changing nothing, if the run was not resumed.
+ */
+static uint64_t resume_at(Simulation *sim)
+{
+    if (sim->resume_offset > 0) {
+        sim->skip_records = sim->resume_skip;
+        sim->trace_records = sim->resume_trace_records;
+    }
+    return sim->resume_offset;
+}
+
+/*
+ * Feeds batch to sim, timing how long that takes.
+ */
+static void time_batch(Simulation *sim, const TraceBatch *batch)
+{
+    double start = seconds_now();
+    dispatch_batch(sim, batch);
+    sim->simulate_seconds += seconds_now() - start;
+    sim->record_count += batch->count;
+}
+
+static void write_interval_header(Simulation *sim)
+{
+    char row[64];
+    output_append(sim->interval_writer, "records", 7);
+    for (int k = 0; k < sim->cache_count; k++) {
+        const Cache *c = &sim->caches[k];
+        static const char *const names[] = {"hits", "misses", "evictions"};
+        for (int n = 0; n < 3; n++) {
+            int length = c->protocol
+                         ? snprintf(row, sizeof(row), ",core%d_%s", k, names[n])
+                         : snprintf(row, sizeof(row), ",s%d_E%d_b%d_%s", c->set_bit_count,
+                                    c->lines_per_set, c->offset_bit_count, names[n]);
+            output_append(sim->interval_writer, row, length);
+        }
+    }
+    output_append(sim->interval_writer, "\n", 1);
+}
+
+/*
+ * Writes the row of the interval that just ended: the number of records
+ * consumed so far, then the counters of each cache over the interval.
+ */
+static void write_interval(Simulation *sim)
+{
+    char row[80];
+    int length = snprintf(row, sizeof(row), "%" PRIu64, sim->record_count);
+    output_append(sim->interval_writer, row, length);
+    for (int k = 0; k < sim->cache_count; k++) {
+        const Cache *c = &sim->caches[k];
+        Counters *last = &sim->interval_last[k];
+        if (sim->cold != NULL && sim->cold[k]) {
+            // Not counted yet
+            *last = (Counters) {c->hits, c->misses, c->evictions};
+        }
+        length = snprintf(row, sizeof(row), ",%" PRIu64 ",%" PRIu64 ",%" PRIu64,
+                          c->hits - last->hits, c->misses - last->misses,
+                          c->evictions - last->evictions);
+        output_append(sim->interval_writer, row, length);
+        last->hits = c->hits;
+        last->misses = c->misses;
+        last->evictions = c->evictions;
+    }
+    output_append(sim->interval_writer, "\n", 1);
+}
+
+/*
+ * Sets up writer on fd, which it will close, and starts its writer thread.
+ * Returns 1 on failure.
+ */
+static int output_open(OutputWriter *writer, int fd)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+    for (int k = 0; k < OUTPUT_BUFFERS; k++) {
+        if ((writer->buffers[k] = malloc(OUTPUT_BUFFER_BYTES)) == NULL) {
+            for (int j = 0; j < k; j++) {
+                free(writer->buffers[j]);
+            }
+            return 1;
+        }
+    }
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->changed, NULL);
+    if (pthread_create(&writer->thread, NULL, run_output_writer, writer) != 0) {
+        for (int k = 0; k < OUTPUT_BUFFERS; k++) {
+            free(writer->buffers[k]);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Hands over the last partial buffer, waits for everything to be written, and
+ * closes the file. Returns 1 if any write failed.
+ */
+static int output_close(OutputWriter *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    if (writer->lengths[writer->filled % OUTPUT_BUFFERS] > 0) {
+        writer->filled++;
+    }
+    writer->closed = 1;
+    pthread_cond_broadcast(&writer->changed);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    int error = writer->error;
+    for (int k = 0; k < OUTPUT_BUFFERS; k++) {
+        free(writer->buffers[k]);
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->changed);
+    return close(writer->fd) == -1 || error;
+}
+
+static void *run_output_writer(void *arg)
+{
+    OutputWriter *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (writer->written == writer->filled && !writer->closed) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        if (writer->written == writer->filled) {
+            pthread_mutex_unlock(&writer->lock);
+            return NULL;
+        }
+        int k = writer->written % OUTPUT_BUFFERS;
+        pthread_mutex_unlock(&writer->lock);
+
+        for (size_t done = 0; done < writer->lengths[k]; ) {
+            ssize_t n = write(writer->fd, writer->buffers[k] + done, writer->lengths[k] - done);
+            if (n <= 0) {
+                writer->error = 1;
+                break;
+            }
+            done += n;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->lengths[k] = 0;
+        writer->written++;
+        pthread_cond_broadcast(&writer->changed);
+    }
+}
+
+/*
+ * Copies length bytes (less than OUTPUT_BUFFER_BYTES) to the stream, handing
+ * the current buffer over first if they do not fit in it.
+ */
+static void output_append(OutputWriter *writer, const char *data, size_t length)
+{
+    int k = writer->filled % OUTPUT_BUFFERS;
+    if (writer->lengths[k] + length > OUTPUT_BUFFER_BYTES) {
+        pthread_mutex_lock(&writer->lock);
+        writer->filled++;
+        pthread_cond_broadcast(&writer->changed);
+        while (writer->filled - writer->written >= OUTPUT_BUFFERS) {
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        }
+        pthread_mutex_unlock(&writer->lock);
+        k = writer->filled % OUTPUT_BUFFERS;
+    }
+    memcpy(writer->buffers[k] + writer->lengths[k], data, length);
+    writer->lengths[k] += length;
+}
+
+/*
+ * Simulates batch on every cache of sim, or routes each of its records to the
+ * worker owning its set.
+ */
+static void dispatch_batch(Simulation *sim, const TraceBatch *batch)
+{
+    if (sim->feed != NULL) {
+        feed_batch(sim->feed, batch);
+        return;
+    }
+    if (sim->caches[0].protocol && sim->workers == NULL) {
+        coherence_batch(sim->caches, sim->cache_count, batch);
+        return;
+    }
+    if (sim->hierarchy != NULL) {
+        simulate_hierarchy_batch(sim->hierarchy, batch);
+        return;
+    }
+    if (sim->split_lines) {
+        // Workers require a single cache, so they see its blocks only
+        for (int k = 0; k < sim->cache_count; k++) {
+            size_t next = 0;
+            uint64_t done = 0;
+            while (next < batch->count) {
+                split_batch(batch, sim->caches[k].offset_bit_count, &next, &done,
+                            sim->split_batch);
+                if (sim->workers == NULL) {
+                    simulate_batch(&sim->caches[k], sim->split_batch);
+                }
+                else {
+                    route_batch(sim, sim->split_batch);
+                }
+            }
+        }
+        return;
+    }
+    if (sim->workers == NULL) {
+        for (int k = 0; k < sim->cache_count; k++) {
+            simulate_batch(&sim->caches[k], batch);
+        }
+        return;
+    }
+    route_batch(sim, batch);
+}
+
+/*
+ * Prints the --stats report of sim, which took seconds in all. The time not
+ * spent simulating or waiting for input is counted as parsing: tokenizing or
+ * decoding, plus page faults on a mapped trace. With --parse-threads, parsing
+ * overlaps simulation and only the part the main thread waited for counts.
+ */
+static void print_stats(const Simulation *sim, double seconds)
+{
+    double parse_seconds = seconds - sim->simulate_seconds - sim->wait_seconds;
+    if (parse_seconds < 0) {
+        parse_seconds = 0;
+    }
+    uint64_t accesses = 0;
+    uint64_t list_accesses = 0;
+    uint64_t probes = 0;
+    uint64_t dedup_hits = 0;
+    for (int k = 0; k < sim->cache_count; k++) {
+        const Cache *c = &sim->caches[k];
+        accesses += c->hits + c->misses;
+        dedup_hits += c->dedup_hits;
+        if (c->engine == ENGINE_LIST) {
+            list_accesses += c->hits + c->misses - c->dedup_hits;
+            probes += c->find_probes;
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(stderr, "stats: total %.3f s, wait %.3f s, parse %.3f s, simulate %.3f s\n",
+            seconds, sim->wait_seconds, parse_seconds, sim->simulate_seconds);
+    fprintf(stderr, "stats: parse %.1f MB/s, %.2f M records/s (%" PRIu64 " bytes, %"
+            PRIu64 " records)\n",
+            parse_seconds > 0 ? sim->byte_count / parse_seconds / 1e6 : 0.0,
+            parse_seconds > 0 ? sim->record_count / parse_seconds / 1e6 : 0.0,
+            sim->byte_count, sim->record_count);
+    fprintf(stderr, "stats: simulate %.2f M accesses/s, %.2f ns/access (%" PRIu64
+            " accesses)\n",
+            sim->simulate_seconds > 0 ? accesses / sim->simulate_seconds / 1e6 : 0.0,
+            accesses > 0 ? sim->simulate_seconds * 1e9 / accesses : 0.0, accesses);
+    if (list_accesses > 0) {
+        fprintf(stderr, "stats: find %.2f probes/access\n", (double) probes / list_accesses);
+    }
+    if (dedup_hits > 0) {
+        fprintf(stderr, "stats: dedup %.1f%% of accesses (%" PRIu64 " hits)\n",
+                100.0 * dedup_hits / accesses, dedup_hits);
+    }
+    fprintf(stderr, "stats: peak rss %ld KB\n", usage.ru_maxrss);
+}
+
+/*
+ * Returns the number of blocks of 2^bits bytes that the size bytes at address
+ * touch. An access of size 0 touches one block.
+ */
+static inline uint64_t block_span(uint64_t address, uint32_t size, int bits)
+{
+    uint64_t last = address + (size ? size - 1 : 0);
+    if (last < address) {
+        last = UINT64_MAX; // Wrapped past the top of the address space
+    }
+    return (last >> bits) - (address >> bits) + 1;
+}
+
+/*
+ * Refills out with the records of batch from record *next on, as one record
+ * per block of 2^bits bytes they touch, of the same operation and with the
+ * address and size of its part of the access. *done counts the blocks of
+ * record *next already emitted. Stops when out is full or batch is used up,
+ * with *next and *done advanced so that the next call carries on.
+ */
+static void split_batch(const TraceBatch *batch, int bits, size_t *next, uint64_t *done,
+                        TraceBatch *out)
+{
+    out->count = 0;
+    while (*next < batch->count && out->count < BATCH_CAPACITY) {
+        size_t i = *next;
+        uint64_t address = batch->address[i];
+        uint64_t span = block_span(address, batch->size[i], bits);
+        uint64_t end = address + batch->size[i];
+        while (*done < span && out->count < BATCH_CAPACITY) {
+            uint64_t start = *done == 0 ? address
+                             : ((address >> bits) + *done) << bits;
+            uint64_t limit = ((start >> bits) + 1) << bits;
+            size_t n = out->count++;
+            out->op[n] = batch->op[i];
+            out->address[n] = start;
+            out->size[n] = (limit < end && limit != 0 ? limit : end) - start;
+            (*done)++;
+        }
+        if (*done == span) {
+            (*next)++;
+            *done = 0;
+        }
+    }
+}
+
+/*
+ * Appends each record of batch to the ring of the worker owning its set.
+ */
+static void route_batch(Simulation *sim, const TraceBatch *batch)
+{
+    Cache *c = &sim->caches[0];
+    uint64_t set_mask = c->set_count - 1;
+    for (size_t i = 0; i < batch->count; i++) {
+        uint64_t set = (batch->address[i] >> c->offset_bit_count) & set_mask;
+        int k = (unsigned __int128) set * sim->worker_count >> c->set_bit_count;
+        Worker *w = &sim->workers[k];
+        TraceBatch *slot = &w->ring[w->head % RING_BATCHES];
+        size_t n = slot->count++;
+        slot->op[n] = batch->op[i];
+        slot->address[n] = batch->address[i];
+        slot->size[n] = batch->size[i];
+        slot->core[n] = batch->core[i];
+        if (slot->count == BATCH_CAPACITY) {
+            publish_batch(w);
+        }
+    }
+}
+
+/*
+ * Feeds the trace open on fd to sim. Regular files are mapped and scanned in
+ * place; pipes, FIFOs, and anything mmap refuses are streamed. Returns 0 on
+ * success and 1 on malformed input.
+ */
+static int simulate_fd(int fd, Simulation *sim)
+{
+    struct stat st;
+    int status = -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        status = simulate_mapped_trace(fd, st.st_size, sim);
+        sim->byte_count = st.st_size;
+    }
+    if (status == -1) {
+        sim->byte_count = 0;
+        status = simulate_stream_trace(fd, sim);
+    }
+    return status;
+}
+
+/*
+ * Reads the traces of core_count cores at once and feeds sim their records
+ * interleaved, one from each core that has any left in turn. Returns 0 on
+ * success, 1 on malformed input, and -1 if a trace could not be opened.
+ */
+static int simulate_cores(CoreTrace *cores, int core_count, Simulation *sim)
+{
+    TraceBatch *out = malloc(sizeof(TraceBatch));
+    if (out == NULL) {
+        return 1;
+    }
+    int started = 0;
+    while (started < core_count) {
+        Worker *feed = &cores[started].feed;
+        feed->ring = malloc(sizeof(TraceBatch) * RING_BATCHES);
+        if (feed->ring == NULL) {
+            break;
+        }
+        feed->ring[0].count = 0;
+        pthread_mutex_init(&feed->lock, NULL);
+        pthread_cond_init(&feed->changed, NULL);
+        if (pthread_create(&cores[started].thread, NULL, run_core_reader, &cores[started]) != 0) {
+            free(feed->ring);
+            pthread_mutex_destroy(&feed->lock);
+            pthread_cond_destroy(&feed->changed);
+            break;
+        }
+        started++;
+    }
+
+    size_t next[MAX_CORES] = {0};
+    int live = started;
+    int alive[MAX_CORES];
+    for (int k = 0; k < started; k++) {
+        alive[k] = 1;
+    }
+    out->count = 0;
+    while (live > 0) {
+        for (int k = 0; k < started; k++) {
+            Worker *feed = &cores[k].feed;
+            while (alive[k]) {
+                int done = __atomic_load_n(&feed->done, __ATOMIC_ACQUIRE);
+                uint64_t head = __atomic_load_n(&feed->head, __ATOMIC_ACQUIRE);
+                if (feed->tail < head) {
+                    break;
+                }
+                if (done) {
+                    alive[k] = 0;
+                    live--;
+                }
+                else {
+                    wait_ring(feed, 0);
+                }
+            }
+            if (!alive[k]) {
+                continue;
+            }
+            const TraceBatch *batch = &feed->ring[feed->tail % RING_BATCHES];
+            size_t n = out->count++;
+            out->address[n] = batch->address[next[k]];
+            out->size[n] = batch->size[next[k]];
+            out->op[n] = batch->op[next[k]];
+            out->core[n] = k;
+            if (++next[k] == batch->count) {
+                next[k] = 0;
+                __atomic_store_n(&feed->tail, feed->tail + 1, __ATOMIC_RELEASE);
+                wake_ring(feed);
+            }
+            if (out->count == BATCH_CAPACITY) {
+                consume_batch(sim, out);
+                out->count = 0;
+            }
+        }
+    }
+    if (out->count > 0) {
+        consume_batch(sim, out);
+    }
+    free(out);
+
+    int status = started < core_count;
+    for (int k = 0; k < started; k++) {
+        pthread_join(cores[k].thread, NULL);
+        free(cores[k].feed.ring);
+        pthread_mutex_destroy(&cores[k].feed.lock);
+        pthread_cond_destroy(&cores[k].feed.changed);
+        sim->byte_count += cores[k].byte_count;
+        if (cores[k].status != 0) {
+            status = status == -1 ? -1 : cores[k].status;
+        }
+    }
+    return status;
+}
+
+/*
+ * Reads the trace of a core into its feed.
+ */
+static void *run_core_reader(void *arg)
+{
+    CoreTrace *core = arg;
+    Simulation sim = {0};
+    sim.parser_count = 1;
+    sim.feed = &core->feed;
+    int fd = open(core->path, O_RDONLY);
+    if (fd == -1) {
+        core->status = -1;
+    }
+    else {
+        core->status = simulate_fd(fd, &sim);
+        close(fd);
+    }
+    core->byte_count = sim.byte_count;
+    __atomic_store_n(&core->feed.done, 1, __ATOMIC_RELEASE);
+    wake_ring(&core->feed);
+    return NULL;
+}
+
+/*
+ * Hands a copy of batch over to the thread reading w.
+ */
+static void feed_batch(Worker *w, const TraceBatch *batch)
+{
+    if (batch->count == 0) {
+        return;
+    }
+    TraceBatch *slot = &w->ring[w->head % RING_BATCHES];
+    slot->count = batch->count;
+    memcpy(slot->address, batch->address, batch->count * sizeof(batch->address[0]));
+    memcpy(slot->size, batch->size, batch->count * sizeof(batch->size[0]));
+    memcpy(slot->op, batch->op, batch->count * sizeof(batch->op[0]));
+    publish_batch(w);
+}
+
+/*
+ * Maps the whole trace and feeds it through tokenize_trace one batch at a
+ * time, so no line is ever copied out of the page cache. Returns 0 on success,
+ * 1 on malformed input, and -1 if the file could not be mapped (the caller then
+ * falls back to stdio).
+ */
+static int simulate_mapped_trace(int fd, off_t length, Simulation *sim)
+{
+    if (length == 0) {
+        return 0;
+    }
+    char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(data, length, MADV_SEQUENTIAL);
+
+    uint64_t offset = resume_at(sim);
+    const char *p = data + offset;
+    const char *end = data + length;
+    if (offset > (uint64_t) length) {
+        munmap(data, length);
+        return 1;
+    }
+    if (length >= BINARY_MAGIC_BYTES && memcmp(data, BINARY_MAGIC, BINARY_MAGIC_BYTES) == 0) {
+        int status = simulate_mapped_binary(data, end, offset > 0 ? offset : BINARY_MAGIC_BYTES,
+                                            sim);
+        munmap(data, length);
+        return status;
+    }
+    if (sim->parser_count > 1 && end - p > CHUNK_BYTES) {
+        int status = simulate_chunked_trace(p, end, offset, sim);
+        munmap(data, length);
+        return status;
+    }
+    TraceBatch *batch = malloc(sizeof(TraceBatch));
+    if (batch == NULL) {
+        munmap(data, length);
+        return -1;
+    }
+    while (p < end && !sim->limit_reached) {
+        batch->count = 0;
+        const char *next = tokenize_trace(p, end, batch);
+        sim->batch_offset = p - data;
+        consume_batch(sim, batch);
+        if (next == p) {
+            break; // Trailing line without a newline
+        }
+        p = next;
+    }
+    free(batch);
+    munmap(data, length);
+    return p == end || sim->limit_reached ? 0 : 1;
+}
+
+/*
+ * Tokenizes [data, end), which starts offset bytes into the trace, with
+ * sim->parser_count parser threads and feeds the chunks to sim in trace order.
+ * Returns 0 on success, 1 on malformed input, and -1 if the threads could not
+ * be set up.
+ */
+static int simulate_chunked_trace(const char *data, const char *end, uint64_t offset,
+                                  Simulation *sim)
+{
+    ChunkedTrace trace = {0};
+    trace.data = data;
+    trace.end = end;
+    trace.chunk_count = (end - data + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    trace.parser_count = sim->parser_count;
+    int slot_count = 2 * trace.parser_count;
+    trace.slots = calloc(slot_count, sizeof(ParsedChunk));
+    trace.parsers = calloc(trace.parser_count, sizeof(ChunkParser));
+    if (trace.slots == NULL || trace.parsers == NULL) {
+        free(trace.slots);
+        free(trace.parsers);
+        return -1;
+    }
+    pthread_mutex_init(&trace.lock, NULL);
+    pthread_cond_init(&trace.changed, NULL);
+    for (int k = 0; k < slot_count; k++) {
+        trace.slots[k].chunk = k;
+    }
+    int started = 0;
+    while (started < trace.parser_count) {
+        ChunkParser *parser = &trace.parsers[started];
+        parser->id = started;
+        parser->trace = &trace;
+        if (pthread_create(&parser->thread, NULL, run_chunk_parser, parser) != 0) {
+            break;
+        }
+        started++;
+    }
+    // Without every parser some chunks would never arrive
+    int status = started == trace.parser_count ? 0 : -1;
+
+    for (uint64_t c = 0; c < trace.chunk_count && status == 0; c++) {
+        ParsedChunk *slot = &trace.slots[c % slot_count];
+        pthread_mutex_lock(&trace.lock);
+        while (!slot->ready) {
+            pthread_cond_wait(&trace.changed, &trace.lock);
+        }
+        pthread_mutex_unlock(&trace.lock);
+
+        for (size_t k = 0; k < slot->batch_count; k++) {
+            sim->batch_offset = offset + slot->batch_offsets[k];
+            consume_batch(sim, &slot->batches[k]);
+        }
+        status = slot->bad;
+
+        pthread_mutex_lock(&trace.lock);
+        slot->ready = 0;
+        slot->chunk = c + slot_count;
+        pthread_cond_broadcast(&trace.changed);
+        pthread_mutex_unlock(&trace.lock);
+    }
+
+    // Let any parser still waiting for a slot see that its chunk is gone
+    pthread_mutex_lock(&trace.lock);
+    for (int k = 0; k < slot_count; k++) {
+        trace.slots[k].chunk = UINT64_MAX;
+        trace.slots[k].ready = 0;
+    }
+    pthread_cond_broadcast(&trace.changed);
+    pthread_mutex_unlock(&trace.lock);
+    for (int k = 0; k < started; k++) {
+        pthread_join(trace.parsers[k].thread, NULL);
+    }
+    for (int k = 0; k < slot_count; k++) {
+        free(trace.slots[k].batches);
+        free(trace.slots[k].batch_offsets);
+    }
+    free(trace.slots);
+    free(trace.parsers);
+    pthread_mutex_destroy(&trace.lock);
+    pthread_cond_destroy(&trace.changed);
+    return status;
+}
+
+static void *run_chunk_parser(void *arg)
+{
+    ChunkParser *parser = arg;
+    ChunkedTrace *trace = parser->trace;
+    int slot_count = 2 * trace->parser_count;
+    for (uint64_t c = parser->id; c < trace->chunk_count; c += trace->parser_count) {
+        ParsedChunk *slot = &trace->slots[c % slot_count];
+        pthread_mutex_lock(&trace->lock);
+        while (slot->chunk < c || slot->ready) {
+            pthread_cond_wait(&trace->changed, &trace->lock);
+        }
+        // The reader may hand the slot on as soon as the lock is released
+        uint64_t chunk = slot->chunk;
+        pthread_mutex_unlock(&trace->lock);
+        if (chunk != c) {
+            return NULL; // The reader stopped early
+        }
+
+        int bad = parse_chunk(trace, c, slot);
+
+        pthread_mutex_lock(&trace->lock);
+        slot->bad = bad;
+        slot->ready = 1;
+        pthread_cond_broadcast(&trace->changed);
+        pthread_mutex_unlock(&trace->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Returns the start of the first line that starts at or after byte
+ * chunk * CHUNK_BYTES, or the end of the trace if there is none.
+ */
+static const char *chunk_start(const ChunkedTrace *trace, uint64_t chunk)
+{
+    if (chunk == 0) {
+        return trace->data;
+    }
+    if (chunk >= trace->chunk_count) {
+        return trace->end;
+    }
+    const char *p = trace->data + chunk * CHUNK_BYTES - 1;
+    const char *newline = memchr(p, '\n', trace->end - p);
+    return newline ? newline + 1 : trace->end;
+}
+
+/*
+ * Tokenizes the lines of chunk into out. Returns 1 if the chunk ends in a line
+ * without a newline, 2 if out could not grow, and 0 otherwise.
+ */
+static int parse_chunk(const ChunkedTrace *trace, uint64_t chunk, ParsedChunk *out)
+{
+    const char *p = chunk_start(trace, chunk);
+    const char *end = chunk_start(trace, chunk + 1);
+    out->batch_count = 0;
+    while (p < end) {
+        if (out->batch_count == out->batch_capacity) {
+            size_t capacity = out->batch_capacity ? 2 * out->batch_capacity : 64;
+            TraceBatch *batches = realloc(out->batches, capacity * sizeof(TraceBatch));
+            if (batches != NULL) {
+                out->batches = batches;
+            }
+            uint64_t *offsets = realloc(out->batch_offsets, capacity * sizeof(uint64_t));
+            if (offsets != NULL) {
+                out->batch_offsets = offsets;
+            }
+            if (batches == NULL || offsets == NULL) {
+                return 2;
+            }
+            out->batch_capacity = capacity;
+        }
+        out->batch_offsets[out->batch_count] = p - trace->data;
+        TraceBatch *batch = &out->batches[out->batch_count++];
+        batch->count = 0;
+        const char *next = tokenize_trace(p, end, batch);
+        if (next == p) {
+            return 1;
+        }
+        p = next;
+    }
+    return 0;
+}
+
+/*
+ * Streams the trace through a StreamReader, for pipes and other inputs that
+ * cannot be mapped. Text is tokenized in place in each buffer, with a partial
+ * last line carried over to the front of the next one. Returns 0 on success
+ * and 1 on malformed input.
+ */
+static int simulate_stream_trace(int fd, Simulation *sim)
+{
+    // A resumed run starts where it stopped if fd can seek there
+    uint64_t offset = 0;
+    int binary = 0;
+    if (sim->resume_offset > 0
+        && lseek(fd, sim->resume_offset, SEEK_SET) == (off_t) sim->resume_offset) {
+        char magic[BINARY_MAGIC_BYTES];
+        binary = pread(fd, magic, sizeof(magic), 0) == BINARY_MAGIC_BYTES
+                 && memcmp(magic, BINARY_MAGIC, BINARY_MAGIC_BYTES) == 0;
+        offset = resume_at(sim);
+    }
+    StreamReader reader;
+    TraceBatch *batch = malloc(sizeof(TraceBatch));
+    if (batch == NULL || stream_open(&reader, fd) == 1) {
+        free(batch);
+        return 1;
+    }
+    size_t length;
+    char *buffer = stream_next(&reader, &length);
+    int status = 0;
+    if (offset == 0 && buffer != NULL && length >= BINARY_MAGIC_BYTES
+        && memcmp(buffer, BINARY_MAGIC, BINARY_MAGIC_BYTES) == 0) {
+        reader.cursor = buffer + BINARY_MAGIC_BYTES;
+        reader.cursor_length = length - BINARY_MAGIC_BYTES;
+        status = simulate_stream_binary(&reader, BINARY_MAGIC_BYTES, sim);
+        buffer = NULL;
+    }
+    else if (binary) {
+        reader.cursor = buffer;
+        reader.cursor_length = buffer != NULL ? length : 0;
+        status = simulate_stream_binary(&reader, offset, sim);
+        buffer = NULL;
+    }
+    size_t carry = 0;
+    while (buffer != NULL && !sim->limit_reached) {
+        const char *p = buffer - carry;
+        const char *end = buffer + length;
+        do {
+            batch->count = 0;
+            // The carried line starts before buffer, which starts at offset
+            sim->batch_offset = offset - (buffer - p);
+            p = tokenize_trace(p, end, batch);
+            consume_batch(sim, batch);
+        } while (batch->count == BATCH_CAPACITY && !sim->limit_reached);
+        if (sim->limit_reached) {
+            carry = 0;
+            break;
+        }
+        carry = end - p;
+        if (carry > STREAM_HEADROOM) {
+            break; // A line longer than the headroom
+        }
+        offset += length;
+        if ((buffer = stream_next(&reader, &length)) != NULL) {
+            memcpy(buffer - carry, p, carry);
+        }
+        stream_release(&reader);
+    }
+    if (carry != 0 || reader.error) {
+        status = 1;
+    }
+    sim->byte_count += reader.byte_count;
+    sim->wait_seconds += reader.wait_seconds;
+    stream_close(&reader);
+    free(batch);
+    return status;
+}
+
+/*
+ * Sets up reader on fd and starts its reader thread. Returns 1 on failure.
+ */
+static int stream_open(StreamReader *reader, int fd)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    for (int k = 0; k < STREAM_BUFFERS; k++) {
+        char *buffer = malloc(STREAM_HEADROOM + STREAM_BUFFER_BYTES);
+        if (buffer == NULL) {
+            for (int j = 0; j < k; j++) {
+                free(reader->buffers[j] - STREAM_HEADROOM);
+            }
+            return 1;
+        }
+        reader->buffers[k] = buffer + STREAM_HEADROOM;
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    if (pthread_create(&reader->thread, NULL, run_stream_reader, reader) != 0) {
+        for (int k = 0; k < STREAM_BUFFERS; k++) {
+            free(reader->buffers[k] - STREAM_HEADROOM);
+        }
+        pthread_mutex_destroy(&reader->lock);
+        pthread_cond_destroy(&reader->changed);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Stops the reader thread, which may be waiting for a buffer to be given back
+ * if the consumer stopped early, and frees the buffers.
+ */
+static void stream_close(StreamReader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->closed = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->thread, NULL);
+    for (int k = 0; k < STREAM_BUFFERS; k++) {
+        free(reader->buffers[k] - STREAM_HEADROOM);
+    }
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+}
+
+static void *run_stream_reader(void *arg)
+{
+    StreamReader *reader = arg;
+    for (uint64_t k = 0; ; k++) {
+        pthread_mutex_lock(&reader->lock);
+        while (k - reader->released >= STREAM_BUFFERS && !reader->closed) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        int closed = reader->closed;
+        pthread_mutex_unlock(&reader->lock);
+        if (closed) {
+            return NULL;
+        }
+
+        // Fill the whole buffer, as pipes return at most a page or so per read
+        char *buffer = reader->buffers[k % STREAM_BUFFERS];
+        size_t length = 0;
+        ssize_t n = 1;
+        while (length < STREAM_BUFFER_BYTES
+               && (n = read(reader->fd, buffer + length, STREAM_BUFFER_BYTES - length)) > 0) {
+            length += n;
+        }
+
+        pthread_mutex_lock(&reader->lock);
+        reader->lengths[k % STREAM_BUFFERS] = length;
+        reader->eof = n <= 0;
+        reader->error = n < 0;
+        reader->filled = k + 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        if (n <= 0) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Waits for the next buffer of the stream and returns it, setting *length to
+ * the number of bytes in it, or returns NULL at the end of the stream. This
+ * does not give back the previous buffer; see stream_release.
+ */
+static char *stream_next(StreamReader *reader, size_t *length)
+{
+    pthread_mutex_lock(&reader->lock);
+    if (reader->filled <= reader->next && !reader->eof) {
+        double start = seconds_now();
+        while (reader->filled <= reader->next && !reader->eof) {
+            pthread_cond_wait(&reader->changed, &reader->lock);
+        }
+        reader->wait_seconds += seconds_now() - start;
+    }
+    char *buffer = NULL;
+    if (reader->filled > reader->next) {
+        buffer = reader->buffers[reader->next % STREAM_BUFFERS];
+        *length = reader->lengths[reader->next % STREAM_BUFFERS];
+        reader->byte_count += *length;
+        reader->next++;
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return buffer;
+}
+
+/*
+ * Gives the oldest buffer taken by stream_next back to the reader thread.
+ */
+static void stream_release(StreamReader *reader)
+{
+    pthread_mutex_lock(&reader->lock);
+    reader->released++;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+}
+
+/*
+ * Copies the next n bytes of the stream from the cursor into dst, moving on to
+ * later buffers as needed. Returns the number of bytes copied, which is less
+ * than n only at the end of the stream.
+ */
+static size_t stream_read(StreamReader *reader, void *dst, size_t n)
+{
+    size_t copied = 0;
+    while (copied < n) {
+        if (reader->cursor_length == 0) {
+            size_t length;
+            char *buffer = stream_next(reader, &length);
+            stream_release(reader);
+            if (buffer == NULL) {
+                break;
+            }
+            reader->cursor = buffer;
+            reader->cursor_length = length;
+            continue;
+        }
+        size_t piece = n - copied < reader->cursor_length ? n - copied : reader->cursor_length;
+        memcpy((char *) dst + copied, reader->cursor, piece);
+        reader->cursor += piece;
+        reader->cursor_length -= piece;
+        copied += piece;
+    }
+    return copied;
+}
+
+/*
+ * Simulates the blocks of a mapped binary trace from the one offset bytes
+ * past data, which points at its magic. Returns 0 on success and 1 on
+ * malformed input.
+ */
+static int simulate_mapped_binary(const char *data, const char *end, uint64_t offset,
+                                  Simulation *sim)
+{
+    TraceBatch *batch = malloc(sizeof(TraceBatch));
+    uint8_t *scratch = malloc(BLOCK_MAX_RAW_BYTES);
+    int status = batch == NULL || scratch == NULL;
+    const char *p = data + offset;
+    while (status == 0 && p < end && !sim->limit_reached) {
+        BlockHeader header;
+        sim->batch_offset = p - data;
+        if ((size_t) (end - p) < sizeof(header)) {
+            status = 1;
+            break;
+        }
+        memcpy(&header, p, sizeof(header));
+        p += sizeof(header);
+        if ((size_t) (end - p) < header.stored_bytes
+            || decode_block(&header, (const uint8_t *) p, scratch, batch) == 1) {
+            status = 1;
+            break;
+        }
+        p += header.stored_bytes;
+        consume_batch(sim, batch);
+    }
+    free(batch);
+    free(scratch);
+    return status;
+}
+
+/*
+ * Simulates the blocks of a binary trace streamed through reader, whose
+ * cursor is at the block offset bytes into the trace, just past the magic or
+ * further. Returns 0 on success and 1 on malformed input.
+ */
+static int simulate_stream_binary(StreamReader *reader, uint64_t offset, Simulation *sim)
+{
+    TraceBatch *batch = malloc(sizeof(TraceBatch));
+    uint8_t *stored = malloc(compress_bound(CODEC_LZ4, BLOCK_MAX_RAW_BYTES));
+    uint8_t *scratch = malloc(BLOCK_MAX_RAW_BYTES);
+    int status = batch == NULL || stored == NULL || scratch == NULL;
+    BlockHeader header;
+    size_t read;
+    while (status == 0 && !sim->limit_reached
+           && (read = stream_read(reader, &header, sizeof(header))) > 0) {
+        if (read != sizeof(header)
+            || header.stored_bytes > compress_bound(CODEC_LZ4, BLOCK_MAX_RAW_BYTES)
+            || stream_read(reader, stored, header.stored_bytes) != header.stored_bytes
+            || decode_block(&header, stored, scratch, batch) == 1) {
+            status = 1;
+            break;
+        }
+        sim->batch_offset = offset;
+        offset += sizeof(header) + header.stored_bytes;
+        consume_batch(sim, batch);
+    }
+    free(batch);
+    free(stored);
+    free(scratch);
+    return status;
+}
+
+static inline uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+/*
+ * Reads a varint from [p, end) into *v. Returns a pointer past it, or NULL if
+ * it runs past end or over 64 bits.
+ */
+static inline const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t res = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        res |= (uint64_t) (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *v = res;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static const char binary_ops[4] = {'L', 'S', 'M', 'I'};
+
+/*
+ * Encodes the records of batch into out, which must have room for
+ * BLOCK_MAX_RAW_BYTES, and returns the number of bytes written.
+ */
+static size_t encode_block(const TraceBatch *batch, uint8_t *out)
+{
+    uint8_t *p = out;
+    uint64_t previous = 0;
+    for (size_t i = 0; i < batch->count; i++) {
+        const char *op = memchr(binary_ops, batch->op[i], sizeof(binary_ops));
+        uint32_t size = batch->size[i];
+        *p++ = (op - binary_ops) << 4 | (size < 16 ? size : 0);
+        if (size == 0 || size >= 16) {
+            p = put_varint(p, size);
+        }
+        int64_t delta = batch->address[i] - previous;
+        p = put_varint(p, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+        previous = batch->address[i];
+    }
+    return p - out;
+}
+
+/*
+ * Decodes the block with the given header and stored payload into batch,
+ * inflating it into scratch (BLOCK_MAX_RAW_BYTES) first if it is compressed.
+ * Returns 1 if the block is malformed or uses a codec this build lacks.
+ */
+static int decode_block(const BlockHeader *header, const uint8_t *stored,
+                        uint8_t *scratch, TraceBatch *batch)
+{
+    if (header->record_count > BATCH_CAPACITY || header->raw_bytes > BLOCK_MAX_RAW_BYTES) {
+        return 1;
+    }
+    const uint8_t *p = stored;
+#if !defined(CSIM_HAVE_ZSTD) && !defined(CSIM_HAVE_LZ4)
+    (void) scratch; // Only compressed blocks inflate into it
+#endif
+    switch (header->codec) {
+    case CODEC_NONE:
+        if (header->stored_bytes != header->raw_bytes) {
+            return 1;
+        }
+        break;
+#ifdef CSIM_HAVE_ZSTD
+    case CODEC_ZSTD: {
+        size_t n = ZSTD_decompress(scratch, BLOCK_MAX_RAW_BYTES, stored, header->stored_bytes);
+        if (ZSTD_isError(n) || n != header->raw_bytes) {
+            return 1;
+        }
+        p = scratch;
+        break;
+    }
+#endif
+#ifdef CSIM_HAVE_LZ4
+    case CODEC_LZ4: {
+        int n = LZ4_decompress_safe((const char *) stored, (char *) scratch,
+                                    header->stored_bytes, BLOCK_MAX_RAW_BYTES);
+        if (n < 0 || (uint32_t) n != header->raw_bytes) {
+            return 1;
+        }
+        p = scratch;
+        break;
+    }
+#endif
+    default:
+        return 1;
+    }
+    const uint8_t *end = p + header->raw_bytes;
+    uint64_t previous = 0;
+    batch->count = 0;
+    for (uint32_t i = 0; i < header->record_count; i++) {
+        if (p == end) {
+            return 1;
+        }
+        uint8_t opsize = *p++;
+        uint64_t size = opsize & 0xf;
+        uint64_t delta;
+        if (size == 0 && (p = get_varint(p, end, &size)) == NULL) {
+            return 1;
+        }
+        if ((p = get_varint(p, end, &delta)) == NULL || opsize >> 4 >= 4 || size > UINT32_MAX) {
+            return 1;
+        }
+        previous += (delta >> 1) ^ -(delta & 1);
+        batch->op[i] = binary_ops[opsize >> 4];
+        batch->address[i] = previous;
+        batch->size[i] = size;
+    }
+    batch->count = header->record_count;
+    return p == end ? 0 : 1;
+}
+
+static size_t compress_bound(Codec codec, size_t raw_bytes)
+{
+    switch (codec) {
+#ifdef CSIM_HAVE_ZSTD
+    case CODEC_ZSTD:
+        return ZSTD_compressBound(raw_bytes);
+#endif
+#ifdef CSIM_HAVE_LZ4
+    case CODEC_LZ4:
+        return LZ4_compressBound(raw_bytes);
+#endif
+    default:
+        // Also an upper bound for both codecs at BLOCK_MAX_RAW_BYTES
+        return raw_bytes + raw_bytes / 128 + 1024;
+    }
+}
+
+/*
+ * Compresses raw into out with codec and returns the compressed size, or 0 if
+ * compression failed.
+ */
+static size_t compress_block(Codec codec, const uint8_t *raw, size_t raw_bytes,
+                             uint8_t *out, size_t capacity)
+{
+    switch (codec) {
+#ifdef CSIM_HAVE_ZSTD
+    case CODEC_ZSTD: {
+        size_t n = ZSTD_compress(out, capacity, raw, raw_bytes, 3);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+#ifdef CSIM_HAVE_LZ4
+    case CODEC_LZ4: {
+        int n = LZ4_compress_default((const char *) raw, (char *) out, raw_bytes, capacity);
+        return n > 0 ? n : 0;
+    }
+#endif
+    default:
+        if (raw_bytes > capacity) {
+            return 0;
+        }
+        memcpy(out, raw, raw_bytes);
+        return raw_bytes;
+    }
+}
+
+/*
+ * csim convert -t <trace> -o <output> [-z none|zstd|lz4]
+ *
+ * Writes a valgrind text trace as a binary trace, optionally compressing each
+ * block. zstd and lz4 are only available when built with -DCSIM_HAVE_ZSTD
+ * (and -lzstd) or -DCSIM_HAVE_LZ4 (and -llz4).
+ */
+static int convert_trace(int argc, char *argv[])
+{
+    int opt;
+    char *t = NULL;
+    char *o = NULL;
+    Codec codec = CODEC_NONE;
+    while ((opt = getopt(argc, argv, "t:o:z:")) != -1) {
+        switch (opt) {
+        case 't':
+            t = optarg;
+            break;
+        case 'o':
+            o = optarg;
+            break;
+        case 'z':
+            if (strcmp(optarg, "none") == 0) {
+                codec = CODEC_NONE;
+            }
+#ifdef CSIM_HAVE_ZSTD
+            else if (strcmp(optarg, "zstd") == 0) {
+                codec = CODEC_ZSTD;
+            }
+#endif
+#ifdef CSIM_HAVE_LZ4
+            else if (strcmp(optarg, "lz4") == 0) {
+                codec = CODEC_LZ4;
+            }
+#endif
+            else {
+                codec = -1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    if (t == NULL || o == NULL || (int) codec == -1) {
+        printf("Bad arguments\n");
+        return 1;
+    }
+    int fd;
+    struct stat st;
+    FILE *out;
+    if ((fd = open(t, O_RDONLY)) == -1 || fstat(fd, &st) == -1 || (out = fopen(o, "wb")) == NULL) {
+        printf("Bad file\n");
+        return 1;
+    }
+    char *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    size_t capacity = compress_bound(codec, BLOCK_MAX_RAW_BYTES);
+    TraceBatch *batch = malloc(sizeof(TraceBatch));
+    uint8_t *raw = malloc(BLOCK_MAX_RAW_BYTES);
+    uint8_t *stored = malloc(capacity);
+    if (data == MAP_FAILED || batch == NULL || raw == NULL || stored == NULL) {
+        printf("Bad initialize\n");
+        return 1;
+    }
+    int status = fwrite(BINARY_MAGIC, 1, BINARY_MAGIC_BYTES, out) != BINARY_MAGIC_BYTES;
+    const char *p = data;
+    const char *end = data + st.st_size;
+    while (status == 0 && p < end) {
+        batch->count = 0;
+        const char *next = tokenize_trace(p, end, batch);
+        if (next == p) {
+            status = 1; // Trailing line without a newline
+            break;
+        }
+        p = next;
+        if (batch->count == 0) {
+            continue;
+        }
+        BlockHeader header;
+        header.record_count = batch->count;
+        header.raw_bytes = encode_block(batch, raw);
+        header.codec = codec;
+        header.stored_bytes = compress_block(codec, raw, header.raw_bytes, stored, capacity);
+        if (header.stored_bytes == 0
+            || fwrite(&header, sizeof(header), 1, out) != 1
+            || fwrite(stored, 1, header.stored_bytes, out) != header.stored_bytes) {
+            status = 1;
+        }
+    }
+    if (fclose(out) != 0) {
+        status = 1;
+    }
+    if (data != NULL) {
+        munmap(data, st.st_size);
+    }
+    close(fd);
+    free(batch);
+    free(raw);
+    free(stored);
+    if (status != 0) {
+        printf("Bad input\n");
+    }
+    return status;
+}
+
+/*
+ * A line of a valgrind memory trace may begin with characters 'L', 'S', 'M', or
+ * 'I'. These characters represents data load, data store, data modify, and
+ * instruction load, respectively. We only consider 'L', 'S', and 'M'.
+ *
+ * For the purposes of this simulator, 'M' is equivalent to 'L' and then 'S',
+ * and 'L' and 'S' are equivalent.
+ *
+ * A line of a valgrind memory trace also contains an address. This address is
+ * parsed in order to determine which CacheSet it corresponds to, and which tag
+ * should be searched for in that CacheSet.
+ */
+static void parse_operation(char *trace_line, char *operation, uint64_t *address)
+{
+    char tmp1[2];
+    char tmp2[20];
+    sscanf(trace_line, "%s %[^,]s,%*s", tmp1, tmp2);
+
+    *operation = tmp1[0];
+    *address = convert_hex_string(tmp2);
+}
+#endif
+
+/*
+ * Simulates one already-parsed trace operation on the raw (unshifted) address.
+ */
+static void simulate_access(Cache *c, char operation, uint64_t address)
+{
+    address >>= c->offset_bit_count; // Don't care about offset
+
+    // printf("%" PRIx64 "\n", ~0 << (uint64_t) 32); // Raises warning
+    uint64_t mask = (uint64_t) ~0 << c->set_bit_count;
+    uint64_t tag = address & mask;
+    uint64_t i = address & ~mask;
+    int count = operation == 'M' ? 2 : operation == 'L' || operation == 'S';
+
+    if (c->last_tag != NULL && count > 0) {
+        if (c->last_tag[i] == ~tag) {
+            c->hits += count;
+            c->dedup_hits += count;
+            if (c->engine == ENGINE_STACK) {
+                c->stack_distance_count[0] += count;
+            }
+            return;
+        }
+        c->last_tag[i] = ~tag;
+    }
+    if (c->engine == ENGINE_SOA) {
+        for (int k = 0; k < count; k++) {
+            simulate_soa_access(c, i, tag);
+        }
+        return;
+    }
+    if (c->engine == ENGINE_HASH) {
+        for (int k = 0; k < count; k++) {
+            simulate_hash_access(c, i, tag);
+        }
+        return;
+    }
+    if (c->engine == ENGINE_STACK) {
+        for (int k = 0; k < count; k++) {
+            simulate_stack_access(c, i, tag);
+        }
+        return;
+    }
+    CacheSet *curr_set = c->sets + i;
+    for (int k = 0; k < count; k++) {
+        simulate_single_access(c, curr_set, tag);
+    }
+}
+
+/*
+ * Simulates one access to the block of address under any engine and policy.
+ */
+static inline void access_block(Cache *c, uint64_t address)
+{
+    if (c->policy == POLICY_LRU) {
+        simulate_access(c, 'L', address);
+    }
+    else {
+        level_access(c, address);
+    }
+}
+
+/*
+ * Simulates batch one record at a time, for the statistics that need to know
+ * which record each hit and miss came from: the sample groups of
+ * --sample-sets and the breakdowns. Records of sets that are not sampled are
+ * dropped.
+ */
+static void detail_batch(Cache *c, const TraceBatch *batch)
+{
+    uint64_t set_mask = c->set_count - 1;
+    for (size_t k = 0; k < batch->count; k++) {
+        uint64_t address = batch->address[k];
+        uint64_t set = (address >> c->offset_bit_count) & set_mask;
+        char operation = batch->op[k];
+        int count = operation == 'M' ? 2 : operation == 'L' || operation == 'S';
+        Counters *group = NULL;
+        if (c->sample_group != NULL) {
+            if (c->sample_group[set] == 0) {
+                continue;
+            }
+            group = &c->sample_groups[c->sample_group[set] - 1];
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        Counters before = {c->hits, c->misses, c->evictions};
+        for (int n = 0; n < count; n++) {
+            uint64_t misses = c->misses;
+            access_block(c, address);
+            if (c->breakdown & BREAKDOWN_MISSES) {
+                classify_miss(c, address, c->misses != misses);
+            }
+        }
+        Counters delta = {c->hits - before.hits, c->misses - before.misses,
+                          c->evictions - before.evictions};
+        Counters *totals[3] = {
+            group,
+            c->breakdown & BREAKDOWN_OPS ? &c->op_counters[BREAKDOWN_OP_INDEX(operation)] : NULL,
+            c->breakdown & BREAKDOWN_SETS ? &c->set_counters[set] : NULL,
+        };
+        for (int t = 0; t < 3; t++) {
+            if (totals[t] != NULL) {
+                totals[t]->hits += delta.hits;
+                totals[t]->misses += delta.misses;
+                totals[t]->evictions += delta.evictions;
+            }
+        }
+    }
+}
+
+/*
+ * Runs the access to the block of address through the shadow cache of c and,
+ * if c missed it, counts the miss as cold, capacity, or conflict.
+ */
+static void classify_miss(Cache *c, uint64_t address, int missed)
+{
+    uint64_t shadow_misses = c->shadow->misses;
+    simulate_access(c->shadow, 'L', address);
+    int first = block_set_insert(c->seen, address >> c->offset_bit_count);
+    if (!missed) {
+        return;
+    }
+    if (first) {
+        c->cold_misses++;
+    }
+    else if (c->shadow->misses != shadow_misses) {
+        c->capacity_misses++;
+    }
+    else {
+        c->conflict_misses++;
+    }
+}
+
+/*
+ * Adds block to set. Returns 1 if it was not there yet, and 0 otherwise or if
+ * the set cannot grow.
+ */
+static int block_set_insert(BlockSet *set, uint64_t block)
+{
+    if (2 * (set->count + 1) > set->capacity) {
+        uint64_t capacity = set->capacity * 2;
+        uint64_t *slots = calloc(capacity, sizeof(uint64_t));
+        if (slots == NULL) {
+            return 0;
+        }
+        for (uint64_t j = 0; j < set->capacity; j++) {
+            if (set->slots[j] != 0) {
+                uint64_t h = (set->slots[j] * 0x9e3779b97f4a7c15) & (capacity - 1);
+                while (slots[h] != 0) {
+                    h = (h + 1) & (capacity - 1);
+                }
+                slots[h] = set->slots[j];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+    uint64_t key = block + 1;
+    uint64_t h = (key * 0x9e3779b97f4a7c15) & (set->capacity - 1);
+    while (set->slots[h] != 0) {
+        if (set->slots[h] == key) {
+            return 0;
+        }
+        h = (h + 1) & (set->capacity - 1);
+    }
+    set->slots[h] = key;
+    set->count++;
+    return 1;
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Returns counter 0 (hits), 1 (misses), or 2 (evictions) of the sampled sets
+ * of c scaled up to all its sets, and stores the half-width of its 95%
+ * confidence interval in *interval. The interval treats the group totals as
+ * independent draws, whose spread estimates that of the total of the sampled
+ * sets, with a finite population correction for the sets it covers.
+ */
+static double sample_estimate(const Cache *c, int counter, double *interval)
+{
+    int groups = c->sampled_set_count < SAMPLE_GROUPS ? c->sampled_set_count : SAMPLE_GROUPS;
+    double sum = 0;
+    double square_sum = 0;
+    for (int k = 0; k < groups; k++) {
+        const Counters *g = &c->sample_groups[k];
+        double x = counter == 0 ? g->hits : counter == 1 ? g->misses : g->evictions;
+        sum += x;
+        square_sum += x * x;
+    }
+    double scale = (double) c->set_count / c->sampled_set_count;
+    *interval = 0;
+    if (groups > 1) {
+        double mean = sum / groups;
+        double variance = (square_sum - groups * mean * mean) / (groups - 1);
+        double spread = variance > 0 ? sqrt(groups * variance) : 0;
+        *interval = 1.96 * scale * spread * sqrt(1 - 1 / scale);
+    }
+    return sum * scale;
+}
+#endif
+
+/*
+ * Returns how many records ahead the batch loops of c prefetch, or 0.
+ */
+static inline size_t prefetch_ahead(const Cache *c)
+{
+    return c->set_count >= PREFETCH_MIN_SETS ? c->prefetch_distance : 0;
+}
+
+/*
+ * Starts loading the state of the set of address into the host's caches: the
+ * words it will look at first under the engine of c.
+ */
+static inline void prefetch_set(const Cache *c, uint64_t address)
+{
+    uint64_t i = (address >> c->offset_bit_count) & (c->set_count - 1);
+    switch (c->engine) {
+    case ENGINE_SOA:
+        __builtin_prefetch(c->soa_tags + i * c->soa_stride);
+        __builtin_prefetch(c->soa_age + i * c->soa_stride);
+        __builtin_prefetch(c->soa_size + i);
+        if (c->policy != POLICY_LRU) {
+            __builtin_prefetch(c->policy_state + i);
+        }
+        break;
+    case ENGINE_HASH:
+        __builtin_prefetch(c->hash_index + i * c->hash_capacity);
+        __builtin_prefetch(c->sets + i);
+        __builtin_prefetch(c->line_arena + i * c->lines_per_set);
+        break;
+    case ENGINE_LIST:
+        __builtin_prefetch(c->sets + i);
+        __builtin_prefetch(c->line_arena + i * c->lines_per_set);
+        break;
+    case ENGINE_STACK:
+        __builtin_prefetch(c->stack_root + i);
+        __builtin_prefetch(c->hash_index + i * c->hash_capacity);
+        break;
+    default:
+        break;
+    }
+    if (c->last_tag != NULL) {
+        __builtin_prefetch(c->last_tag + i);
+    }
+}
+
+/*
+ * The batch loops of the policies other than LRU, each with policy_access
+ * specialized for its policy, by Policy.
+ */
+static void (*const policy_batches[POLICY_COUNT])(Cache *, const TraceBatch *) = {
+    [POLICY_FIFO] = simulate_fifo_batch,
+    [POLICY_RANDOM] = simulate_random_batch,
+    [POLICY_PLRU] = simulate_plru_batch,
+    [POLICY_NRU] = simulate_nru_batch,
+    [POLICY_SRRIP] = simulate_srrip_batch,
+    [POLICY_BRRIP] = simulate_brrip_batch,
+    [POLICY_LFU] = simulate_lfu_batch,
+};
+
+static void simulate_batch(Cache *c, const TraceBatch *batch)
+{
+    if (c->sample_group != NULL || c->breakdown) {
+        detail_batch(c, batch);
+        return;
+    }
+    if (c->prefetcher != NULL) {
+        prefetcher_batch(c, batch);
+        return;
+    }
+    if (c->write_mode) {
+        write_batch(c, batch);
+        return;
+    }
+    if (c->policy != POLICY_LRU) {
+        policy_batches[c->policy](c, batch);
+        return;
+    }
+    size_t ahead = prefetch_ahead(c);
+    for (size_t i = 0; i < batch->count; i++) {
+        if (ahead > 0 && i + ahead < batch->count) {
+            prefetch_set(c, batch->address[i + ahead]);
+        }
+        simulate_access(c, batch->op[i], batch->address[i]);
+    }
+}
+
+static void simulate_single_access(Cache *c, CacheSet *curr_set, uint64_t tag)
+{
+    CacheLine *match = find(curr_set, tag, &c->find_probes);
+    if (match == NULL) {
+        // Miss
+        c->misses++;
+        CacheLine *new_line;
+        if (curr_set->size >= c->lines_per_set) {
+            // Eviction
+            c->evictions++;
+            new_line = evict(curr_set, curr_set->lru);
+        }
+        else {
+            new_line = c->line_arena + (curr_set - c->sets) * c->lines_per_set
+                       + curr_set->size;
+        }
+        new_line->tag = tag;
+        push(curr_set, new_line);
+    }
+    else {
+        // Hit
+        c->hits++;
+        evict(curr_set, match);
+        push(curr_set, match);
+    }
+}
+
+/*
+ * The hash counterpart of simulate_single_access: the same list updates, but
+ * the line is located through the set's hash_index table instead of find().
+ */
+static void simulate_hash_access(Cache *c, uint64_t i, uint64_t tag)
+{
+    CacheSet *curr_set = c->sets + i;
+    CacheLine *lines = c->line_arena + i * c->lines_per_set;
+    uint32_t *index = c->hash_index + i * c->hash_capacity;
+    uint32_t *slot = hash_slot(c, index, lines, sizeof(CacheLine), tag);
+    if (*slot != 0) {
+        // Hit
+        c->hits++;
+        CacheLine *match = lines + *slot - 1;
+        evict(curr_set, match);
+        push(curr_set, match);
+        return;
+    }
+    // Miss
+    c->misses++;
+    CacheLine *new_line;
+    if (curr_set->size >= c->lines_per_set) {
+        // Eviction
+        c->evictions++;
+        new_line = evict(curr_set, curr_set->lru);
+        hash_remove(c, index, lines, sizeof(CacheLine),
+                    hash_slot(c, index, lines, sizeof(CacheLine), new_line->tag));
+        // The removal may have moved entries
+        slot = hash_slot(c, index, lines, sizeof(CacheLine), tag);
+    }
+    else {
+        new_line = lines + curr_set->size;
+    }
+    new_line->tag = tag;
+    push(curr_set, new_line);
+    *slot = new_line - lines + 1;
+}
+
+/*
+ * The entries a hash_index table points into are the set's CacheLines or
+ * StackNodes, both of which start with their tag.
+ */
+#define ENTRY_TAG(entries, entry_size, n) \
+    (*(const uint64_t *) ((const char *) (entries) + ((n) - 1) * (entry_size)))
+
+/*
+ * Returns the slot of index holding tag, or the empty slot where tag would be
+ * inserted.
+ */
+static uint32_t *hash_slot(const Cache *c, uint32_t *index, const void *entries,
+                           size_t entry_size, uint64_t tag)
+{
+    uint64_t mask = c->hash_capacity - 1;
+    uint64_t h = (tag * 0x9e3779b97f4a7c15) >> c->hash_shift;
+    while (index[h] != 0 && ENTRY_TAG(entries, entry_size, index[h]) != tag) {
+        h = (h + 1) & mask;
+    }
+    return index + h;
+}
+
+/*
+ * Empties slot, then moves back any later entry of the same probe run that
+ * could no longer be reached from its home slot.
+ */
+static void hash_remove(const Cache *c, uint32_t *index, const void *entries,
+                        size_t entry_size, uint32_t *slot)
+{
+    uint64_t mask = c->hash_capacity - 1;
+    uint64_t hole = slot - index;
+    uint64_t h = hole;
+    index[hole] = 0;
+    while (1) {
+        h = (h + 1) & mask;
+        if (index[h] == 0) {
+            return;
+        }
+        uint64_t tag = ENTRY_TAG(entries, entry_size, index[h]);
+        uint64_t home = (tag * 0x9e3779b97f4a7c15) >> c->hash_shift;
+        // Move the entry unless its home lies cyclically in (hole, h]
+        if (((h - home) & mask) >= ((h - hole) & mask)) {
+            index[hole] = index[h];
+            index[h] = 0;
+            hole = h;
+        }
+    }
+}
+
+/*
+ * The stack counterpart of simulate_single_access. Counts the access at its
+ * stack distance (or as a miss with the current stack depth) and moves its
+ * block to the top of the set's stack, dropping the bottom block if the stack
+ * is already lines_per_set deep. The counters of the Cache itself are those of
+ * an LRU cache with lines_per_set lines per set.
+ */
+static void simulate_stack_access(Cache *c, uint64_t i, uint64_t tag)
+{
+    StackNode *nodes = c->stack_nodes + i * c->lines_per_set;
+    uint32_t *index = c->hash_index + i * c->hash_capacity;
+    uint32_t root = c->stack_root[i];
+    uint32_t depth = root ? nodes[root - 1].size : 0;
+    uint32_t *slot = hash_slot(c, index, nodes, sizeof(StackNode), tag);
+    uint32_t n = *slot;
+    if (n != 0) {
+        // Hit
+        c->hits++;
+        StackNode *node = &nodes[n - 1];
+        c->stack_distance_count[stack_newer_count(nodes, root, node->time)]++;
+        root = stack_erase(nodes, root, node->time);
+    }
+    else {
+        // Miss
+        c->misses++;
+        c->stack_fill_count[depth]++;
+        if (depth >= (uint32_t) c->lines_per_set) {
+            // Eviction
+            c->evictions++;
+            n = stack_oldest(nodes, root);
+            root = stack_erase(nodes, root, nodes[n - 1].time);
+            hash_remove(c, index, nodes, sizeof(StackNode),
+                        hash_slot(c, index, nodes, sizeof(StackNode), nodes[n - 1].tag));
+            // The removal may have moved entries
+            slot = hash_slot(c, index, nodes, sizeof(StackNode), tag);
+        }
+        else {
+            n = depth + 1;
+        }
+        // xorshift64
+        c->stack_seed ^= c->stack_seed << 13;
+        c->stack_seed ^= c->stack_seed >> 7;
+        c->stack_seed ^= c->stack_seed << 17;
+        nodes[n - 1].tag = tag;
+        nodes[n - 1].priority = c->stack_seed >> 32;
+        *slot = n;
+    }
+    nodes[n - 1].time = ++c->stack_clock;
+    c->stack_root[i] = stack_insert_newest(nodes, root, n);
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Computes the counters a cache with the given number of lines per set (at
+ * most c->lines_per_set) would have reported on the trace c has seen.
+ */
+static void stack_counters(const Cache *c, int lines, uint64_t *hits,
+                           uint64_t *misses, uint64_t *evictions)
+{
+    *hits = 0;
+    *misses = 0;
+    *evictions = 0;
+    for (int d = 0; d < c->lines_per_set; d++) {
+        if (d < lines) {
+            *hits += c->stack_distance_count[d];
+        }
+        else {
+            *misses += c->stack_distance_count[d];
+            *evictions += c->stack_distance_count[d];
+        }
+    }
+    for (int n = 0; n <= c->lines_per_set; n++) {
+        *misses += c->stack_fill_count[n];
+        if (n >= lines) {
+            *evictions += c->stack_fill_count[n];
+        }
+    }
+}
+#endif
+
+static inline void stack_update(StackNode *nodes, uint32_t n)
+{
+    StackNode *node = &nodes[n - 1];
+    node->size = 1 + (node->left ? nodes[node->left - 1].size : 0)
+                   + (node->right ? nodes[node->right - 1].size : 0);
+}
+
+/*
+ * Inserts node n, whose time must be newer than every time in the treap, and
+ * returns the new root.
+ */
+static uint32_t stack_insert_newest(StackNode *nodes, uint32_t root, uint32_t n)
+{
+    StackNode *node = &nodes[n - 1];
+    if (root == 0 || node->priority > nodes[root - 1].priority) {
+        node->left = root;
+        node->right = 0;
+        stack_update(nodes, n);
+        return n;
+    }
+    nodes[root - 1].right = stack_insert_newest(nodes, nodes[root - 1].right, n);
+    stack_update(nodes, root);
+    return root;
+}
+
+/*
+ * Removes the node with the given time and returns the new root.
+ */
+static uint32_t stack_erase(StackNode *nodes, uint32_t root, uint64_t time)
+{
+    StackNode *node = &nodes[root - 1];
+    if (node->time == time) {
+        return stack_merge(nodes, node->left, node->right);
+    }
+    if (time < node->time) {
+        node->left = stack_erase(nodes, node->left, time);
+    }
+    else {
+        node->right = stack_erase(nodes, node->right, time);
+    }
+    node->size--;
+    return root;
+}
+
+/*
+ * Joins two treaps where every time in a is older than every time in b.
+ */
+static uint32_t stack_merge(StackNode *nodes, uint32_t a, uint32_t b)
+{
+    if (a == 0 || b == 0) {
+        return a ? a : b;
+    }
+    if (nodes[a - 1].priority > nodes[b - 1].priority) {
+        nodes[a - 1].right = stack_merge(nodes, nodes[a - 1].right, b);
+        stack_update(nodes, a);
+        return a;
+    }
+    nodes[b - 1].left = stack_merge(nodes, a, nodes[b - 1].left);
+    stack_update(nodes, b);
+    return b;
+}
+
+static uint32_t stack_oldest(const StackNode *nodes, uint32_t root)
+{
+    while (nodes[root - 1].left != 0) {
+        root = nodes[root - 1].left;
+    }
+    return root;
+}
+
+/*
+ * Returns the number of nodes whose time is newer than time.
+ */
+static uint32_t stack_newer_count(const StackNode *nodes, uint32_t root, uint64_t time)
+{
+    uint32_t count = 0;
+    while (root != 0) {
+        const StackNode *node = &nodes[root - 1];
+        if (node->time > time) {
+            count += 1 + (node->right ? nodes[node->right - 1].size : 0);
+            root = node->left;
+        }
+        else {
+            root = node->right;
+        }
+    }
+    return count;
+}
+
+/*
+ * The soa counterpart of simulate_single_access. A hit ages every line that
+ * was more recent than the hit line; a miss ages every line and takes either
+ * the next free way or the way whose age is lines_per_set-1 (the lru).
+ * Returns the tag of the line it evicted, or SOA_HOLE if there was none.
+ */
+static uint64_t simulate_soa_access(Cache *c, uint64_t i, uint64_t tag)
+{
+    uint64_t stride = c->soa_stride;
+    uint64_t *tags = c->soa_tags + i * stride;
+    uint8_t *age = c->soa_age + i * stride;
+    int size = c->soa_size[i];
+
+    uint64_t valid = size == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << size) - 1;
+    uint64_t match = soa_match(tags, stride, tag) & valid;
+    if (match != 0) {
+        // Hit
+        c->hits++;
+        int way = __builtin_ctzll(match);
+        uint8_t hit_age = age[way];
+        for (uint64_t j = 0; j < stride; j++) {
+            age[j] += age[j] < hit_age;
+        }
+        age[way] = 0;
+        return SOA_HOLE;
+    }
+    // Miss
+    c->misses++;
+    uint64_t hole = c->soa_holes ? soa_match(tags, stride, SOA_HOLE) & valid : 0;
+    if (hole != 0) {
+        // Refill an invalidated way, which keeps the ages a permutation
+        int way = __builtin_ctzll(hole);
+        uint8_t hole_age = age[way];
+        for (uint64_t j = 0; j < stride; j++) {
+            age[j] += age[j] < hole_age;
+        }
+        tags[way] = tag;
+        age[way] = 0;
+        return SOA_HOLE;
+    }
+    int way;
+    uint64_t victim = SOA_HOLE;
+    if (size >= c->lines_per_set) {
+        // Eviction
+        c->evictions++;
+        uint8_t lru_age = c->lines_per_set - 1;
+        way = 0;
+        while (age[way] != lru_age) {
+            way++;
+        }
+        victim = tags[way];
+    }
+    else {
+        way = size;
+        c->soa_size[i] = size + 1;
+    }
+    for (uint64_t j = 0; j < stride; j++) {
+        age[j]++;
+    }
+    tags[way] = tag;
+    age[way] = 0;
+    return victim;
+}
+
+/*
+ * Returns the next number of the xorshift64 generator of set i. A set's state
+ * starts at 0 and is seeded from i on its first draw.
+ */
+static inline uint64_t policy_random(Cache *c, uint64_t i)
+{
+    uint64_t x = c->policy_state[i];
+    if (x == 0) {
+        // The splitmix64 mix, a bijection that takes only 0 to 0
+        x = (i + 1) * 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        x ^= x >> 31;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    c->policy_state[i] = x;
+    return x;
+}
+
+/*
+ * Points the PLRU tree bits of state away from way, in a set of lines ways
+ * (a power of two). Tree node n is bit n of state, with node 1 the root and
+ * nodes 2n and 2n + 1 its children; a bit of 0 sends the next victim left.
+ */
+static inline uint64_t plru_touch(uint64_t state, int lines, int way)
+{
+    uint64_t node = 1;
+    for (int level = __builtin_ctz(lines) - 1; level >= 0; level--) {
+        uint64_t right = (way >> level) & 1;
+        state = (state & ~((uint64_t) 1 << node)) | (right ^ 1) << node;
+        node = 2 * node + right;
+    }
+    return state;
+}
+
+static inline int plru_victim(uint64_t state, int lines)
+{
+    uint64_t node = 1;
+    while (node < (uint64_t) lines) {
+        node = 2 * node + ((state >> node) & 1);
+    }
+    return node - lines;
+}
+
+/*
+ * Sets the NRU reference bit of way in a set of size valid ways. Once every
+ * way of a full set is referenced, clears all but way's.
+ */
+static inline void nru_touch(uint8_t *age, int size, int lines, int way)
+{
+    age[way] = 1;
+    if (size == lines) {
+        int referenced = 0;
+        for (int j = 0; j < lines; j++) {
+            referenced += age[j];
+        }
+        if (referenced == lines) {
+            memset(age, 0, lines);
+            age[way] = 1;
+        }
+    }
+}
+
+/*
+ * The counterpart of simulate_soa_access for the policies other than LRU, with
+ * soa_age holding per-way state: the reference bit under NRU, the RRPV under
+ * SRRIP and BRRIP, and the use count under LFU (halved across the set when one
+ * would overflow). Every call passes a constant policy and is inlined, so each
+ * batch loop below compiles to the code of one policy only. Returns the tag of
+ * the line it evicted, or SOA_HOLE if there was none.
+ */
+static inline __attribute__((always_inline))
+uint64_t policy_access(Cache *c, uint64_t i, uint64_t tag, Policy policy)
+{
+    uint64_t stride = c->soa_stride;
+    uint64_t *tags = c->soa_tags + i * stride;
+    uint8_t *age = c->soa_age + i * stride;
+    int size = c->soa_size[i];
+    int lines = c->lines_per_set;
+
+    uint64_t valid = size == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << size) - 1;
+    uint64_t match = soa_match(tags, stride, tag) & valid;
+    int way;
+    if (match != 0) {
+        // Hit
+        c->hits++;
+        way = __builtin_ctzll(match);
+        switch (policy) {
+        case POLICY_PLRU:
+            c->policy_state[i] = plru_touch(c->policy_state[i], lines, way);
+            break;
+        case POLICY_NRU:
+            nru_touch(age, size, lines, way);
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP:
+            age[way] = 0;
+            break;
+        case POLICY_LFU:
+            if (age[way] == UINT8_MAX) {
+                for (int j = 0; j < size; j++) {
+                    age[j] >>= 1;
+                }
+            }
+            age[way]++;
+            break;
+        default:
+            break;
+        }
+        return SOA_HOLE;
+    }
+    // Miss
+    c->misses++;
+    uint64_t hole = c->soa_holes ? soa_match(tags, stride, SOA_HOLE) & valid : 0;
+    uint64_t victim = SOA_HOLE;
+    if (hole != 0) {
+        way = __builtin_ctzll(hole);
+    }
+    else if (size >= lines) {
+        // Eviction
+        c->evictions++;
+        switch (policy) {
+        case POLICY_FIFO:
+            way = c->policy_state[i];
+            c->policy_state[i] = way + 1 == lines ? 0 : way + 1;
+            break;
+        case POLICY_RANDOM:
+            way = (uint32_t) (policy_random(c, i) >> 32) * (uint64_t) lines >> 32;
+            break;
+        case POLICY_PLRU:
+            way = plru_victim(c->policy_state[i], lines);
+            break;
+        case POLICY_NRU:
+            way = 0;
+            while (way < lines - 1 && age[way] != 0) {
+                way++;
+            }
+            break;
+        case POLICY_SRRIP:
+        case POLICY_BRRIP: {
+            // Age every way by as much as it takes for the oldest to be distant
+            uint8_t oldest = 0;
+            for (int j = 0; j < lines; j++) {
+                oldest = age[j] > oldest ? age[j] : oldest;
+            }
+            way = -1;
+            for (int j = 0; j < lines; j++) {
+                age[j] += RRPV_DISTANT - oldest;
+                if (way == -1 && age[j] == RRPV_DISTANT) {
+                    way = j;
+                }
+            }
+            break;
+        }
+        case POLICY_LFU:
+            way = 0;
+            for (int j = 1; j < lines; j++) {
+                way = age[j] < age[way] ? j : way;
+            }
+            break;
+        default:
+            way = 0;
+            break;
+        }
+        victim = tags[way];
+    }
+    else {
+        way = size;
+        c->soa_size[i] = size + 1;
+    }
+    tags[way] = tag;
+    switch (policy) {
+    case POLICY_PLRU:
+        c->policy_state[i] = plru_touch(c->policy_state[i], lines, way);
+        break;
+    case POLICY_NRU:
+        nru_touch(age, c->soa_size[i], lines, way);
+        break;
+    case POLICY_SRRIP:
+        age[way] = RRPV_LONG;
+        break;
+    case POLICY_BRRIP:
+        age[way] = policy_random(c, i) % BRRIP_LONG_ODDS == 0 ? RRPV_LONG : RRPV_DISTANT;
+        break;
+    case POLICY_LFU:
+        age[way] = 1;
+        break;
+    default:
+        break;
+    }
+    return victim;
+}
+
+/*
+ * Defines simulate_<name>_batch, the batch loop of policy. These replace
+ * simulate_batch for their policies; see policy_batches.
+ */
+#define POLICY_BATCH(name, policy)                                          \
+    static void simulate_##name##_batch(Cache *c, const TraceBatch *batch)  \
+    {                                                                       \
+        uint64_t mask = (uint64_t) ~0 << c->set_bit_count;                  \
+        size_t ahead = prefetch_ahead(c);                                   \
+        for (size_t k = 0; k < batch->count; k++) {                         \
+            if (ahead > 0 && k + ahead < batch->count) {                    \
+                prefetch_set(c, batch->address[k + ahead]);                 \
+            }                                                               \
+            uint64_t address = batch->address[k] >> c->offset_bit_count;    \
+            char operation = batch->op[k];                                  \
+            int count = operation == 'M' ? 2 : operation == 'L' || operation == 'S'; \
+            for (int n = 0; n < count; n++) {                               \
+                policy_access(c, address & ~mask, address & mask, policy);  \
+            }                                                               \
+        }                                                                   \
+    }
+
+POLICY_BATCH(fifo, POLICY_FIFO)
+POLICY_BATCH(random, POLICY_RANDOM)
+POLICY_BATCH(plru, POLICY_PLRU)
+POLICY_BATCH(nru, POLICY_NRU)
+POLICY_BATCH(srrip, POLICY_SRRIP)
+POLICY_BATCH(brrip, POLICY_BRRIP)
+POLICY_BATCH(lfu, POLICY_LFU)
+
+/*
+ * Simulates one access to address at a level of a hierarchy, counted as usual.
+ * Returns the address of the block it evicted, or NO_VICTIM.
+ */
+static uint64_t level_access(Cache *c, uint64_t address)
+{
+    uint64_t block = address >> c->offset_bit_count;
+    uint64_t mask = (uint64_t) ~0 << c->set_bit_count;
+    uint64_t i = block & ~mask;
+    uint64_t tag = block & mask;
+    uint64_t victim;
+    switch (c->policy) {
+    case POLICY_FIFO:
+        victim = policy_access(c, i, tag, POLICY_FIFO);
+        break;
+    case POLICY_RANDOM:
+        victim = policy_access(c, i, tag, POLICY_RANDOM);
+        break;
+    case POLICY_PLRU:
+        victim = policy_access(c, i, tag, POLICY_PLRU);
+        break;
+    case POLICY_NRU:
+        victim = policy_access(c, i, tag, POLICY_NRU);
+        break;
+    case POLICY_SRRIP:
+        victim = policy_access(c, i, tag, POLICY_SRRIP);
+        break;
+    case POLICY_BRRIP:
+        victim = policy_access(c, i, tag, POLICY_BRRIP);
+        break;
+    case POLICY_LFU:
+        victim = policy_access(c, i, tag, POLICY_LFU);
+        break;
+    default:
+        victim = simulate_soa_access(c, i, tag);
+        break;
+    }
+    return victim == SOA_HOLE ? NO_VICTIM : (victim | i) << c->offset_bit_count;
+}
+
+/*
+ * Returns the way holding the block of address at a level, or -1 if it is
+ * not there. Counts nothing.
+ */
+static int level_probe(const Cache *c, uint64_t address)
+{
+    uint64_t block = address >> c->offset_bit_count;
+    uint64_t mask = (uint64_t) ~0 << c->set_bit_count;
+    uint64_t i = block & ~mask;
+    int size = c->soa_size[i];
+    uint64_t valid = size == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << size) - 1;
+    uint64_t match = soa_match(c->soa_tags + i * c->soa_stride, c->soa_stride,
+                               block & mask) & valid;
+    return match != 0 ? __builtin_ctzll(match) : -1;
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Drops the block of address from a level. Returns 1 if it was there.
+ */
+static int level_invalidate(Cache *c, uint64_t address)
+{
+    int way = level_probe(c, address);
+    if (way == -1) {
+        return 0;
+    }
+    uint64_t i = (address >> c->offset_bit_count) & (c->set_count - 1);
+    c->soa_tags[i * c->soa_stride + way] = SOA_HOLE;
+    c->soa_holes = 1;
+    return 1;
+}
+
+/*
+ * Fills a level with the block of address, evicted from the level above, if
+ * it is not there already. This is not an access, so only an eviction it
+ * causes is counted. Returns the address of the block it evicted, or
+ * NO_VICTIM.
+ */
+static uint64_t level_insert(Cache *c, uint64_t address)
+{
+    if (level_probe(c, address) != -1) {
+        return NO_VICTIM;
+    }
+    uint64_t victim = level_access(c, address);
+    c->misses--;
+    return victim;
+}
+
+/*
+ * Invalidates the block of 2^bits bytes at victim, just evicted from
+ * h->lower[level], in the L1s and every lower level above that one.
+ */
+static void back_invalidate(const Hierarchy *h, int level, uint64_t victim, int bits)
+{
+    Cache *uppers[2 + MAX_LOWER_LEVELS] = {h->l1d, h->l1i};
+    int upper_count = 2;
+    for (int k = 0; k < level; k++) {
+        uppers[upper_count++] = h->lower[k];
+    }
+    for (int k = 0; k < upper_count; k++) {
+        Cache *c = uppers[k];
+        if (c == NULL) {
+            continue;
+        }
+        // c has blocks no bigger than the victim's, so it may hold several
+        uint64_t count = (uint64_t) 1 << (bits - c->offset_bit_count);
+        for (uint64_t j = 0; j < count; j++) {
+            c->invalidations += level_invalidate(c, victim + (j << c->offset_bit_count));
+        }
+    }
+}
+
+/*
+ * Simulates one access to address that starts at the L1 first.
+ */
+static void hierarchy_access(const Hierarchy *h, Cache *first, uint64_t address)
+{
+    int hit = level_probe(first, address) != -1;
+    uint64_t victim = level_access(first, address);
+    if (hit) {
+        return;
+    }
+    if (h->inclusion == INCLUSION_EXCLUSIVE) {
+        for (int k = 0; k < h->lower_count; k++) {
+            Cache *c = h->lower[k];
+            if (level_probe(c, address) != -1) {
+                // The block moves up to the first level
+                c->hits++;
+                level_invalidate(c, address);
+                break;
+            }
+            c->misses++;
+        }
+        // Each level takes the victim of the level above
+        for (int k = 0; k < h->lower_count && victim != NO_VICTIM; k++) {
+            victim = level_insert(h->lower[k], victim);
+        }
+        return;
+    }
+    for (int k = 0; k < h->lower_count; k++) {
+        Cache *c = h->lower[k];
+        hit = level_probe(c, address) != -1;
+        victim = level_access(c, address);
+        if (victim != NO_VICTIM && h->inclusion == INCLUSION_INCLUSIVE) {
+            back_invalidate(h, k, victim, c->offset_bit_count);
+        }
+        if (hit) {
+            return;
+        }
+    }
+}
+#endif
+
+/*
+ * Simulates batch on c with its prefetchers, a record at a time.
+ */
+static void prefetcher_batch(Cache *c, const TraceBatch *batch)
+{
+    for (size_t k = 0; k < batch->count; k++) {
+        char operation = batch->op[k];
+        int count = operation == 'M' ? 2 : operation == 'L' || operation == 'S';
+        for (int n = 0; n < count; n++) {
+            prefetcher_access(c, batch->address[k]);
+        }
+    }
+}
+
+/*
+ * Simulates a demand access to address and lets the prefetchers train on it.
+ * The next-line and stream prefetchers only act on the accesses that would
+ * have missed without them: misses and first hits on prefetched blocks.
+ */
+static void prefetcher_access(Cache *c, uint64_t address)
+{
+    uint64_t i = (address >> c->offset_bit_count) & (c->set_count - 1);
+    int way = level_probe(c, address);
+    int prefetch_hit = way != -1 && (c->prefetched[i] >> way & 1);
+    if (prefetch_hit) {
+        c->prefetcher->hits++;
+        c->prefetched[i] &= ~((uint64_t) 1 << way);
+    }
+    uint64_t victim = level_access(c, address);
+    if (way == -1) {
+        note_fill(c, address, victim, 0);
+    }
+    prefetch_train(c, address >> c->offset_bit_count, way == -1 || prefetch_hit);
+}
+
+static void prefetch_train(Cache *c, uint64_t block, int triggered)
+{
+    Prefetcher *p = c->prefetcher;
+    int page_shift = PREFETCH_PAGE_BITS > c->offset_bit_count
+                     ? PREFETCH_PAGE_BITS - c->offset_bit_count : 0;
+    uint64_t page = block >> page_shift;
+    if ((c->prefetchers & PREFETCH_NEXT_LINE) && triggered) {
+        prefetch_block(c, block + 1, page);
+    }
+    if (c->prefetchers & PREFETCH_STRIDE) {
+        StrideEntry *e = &p->strides[(page * 0x9e3779b97f4a7c15) >> 56];
+        if (e->region != page) {
+            e->region = page;
+            e->stride = 0;
+            e->confidence = 0;
+        }
+        else if (block != e->last_block) {
+            int64_t stride = block - e->last_block;
+            if (stride == e->stride) {
+                e->confidence += e->confidence < 3;
+            }
+            else {
+                e->stride = stride;
+                e->confidence = 0;
+            }
+            for (int d = 1; d <= STRIDE_DEGREE && e->confidence > 0; d++) {
+                prefetch_block(c, block + d * stride, page);
+            }
+        }
+        e->last_block = block;
+    }
+    if ((c->prefetchers & PREFETCH_STREAM) && triggered) {
+        Stream *s = NULL;
+        Stream *oldest = &p->streams[0];
+        for (int k = 0; k < STREAM_COUNT; k++) {
+            Stream *t = &p->streams[k];
+            if (t->used != 0 && t->next <= block && block <= t->end + 1) {
+                s = t;
+                break;
+            }
+            if (t->used < oldest->used) {
+                oldest = t;
+            }
+        }
+        if (s == NULL) {
+            // Start a stream, which prefetches once the next block is accessed
+            s = oldest;
+            s->end = block;
+        }
+        else {
+            for (uint64_t b = s->end + 1 > block + 1 ? s->end + 1 : block + 1;
+                 b <= block + STREAM_DEPTH; b++) {
+                prefetch_block(c, b, page);
+            }
+            s->end = s->end > block + STREAM_DEPTH ? s->end : block + STREAM_DEPTH;
+        }
+        s->next = block + 1;
+        s->used = ++p->clock;
+    }
+}
+
+/*
+ * Fills c with block, unless it is there already or leaves page.
+ */
+static void prefetch_block(Cache *c, uint64_t block, uint64_t page)
+{
+    int page_shift = PREFETCH_PAGE_BITS > c->offset_bit_count
+                     ? PREFETCH_PAGE_BITS - c->offset_bit_count : 0;
+    uint64_t address = block << c->offset_bit_count;
+    if (block >> page_shift != page || level_probe(c, address) != -1) {
+        return;
+    }
+    Prefetcher *p = c->prefetcher;
+    uint64_t victim = level_access(c, address);
+    c->misses--;
+    if (victim != NO_VICTIM) {
+        c->evictions--;
+        p->evictions++;
+    }
+    p->fills++;
+    note_fill(c, address, victim, 1);
+}
+
+/*
+ * Records that the block of address just filled its way of c, evicting
+ * victim, and was prefetched or not.
+ */
+static void note_fill(Cache *c, uint64_t address, uint64_t victim, int prefetched)
+{
+    uint64_t i = (address >> c->offset_bit_count) & (c->set_count - 1);
+    uint64_t bit = (uint64_t) 1 << level_probe(c, address);
+    if (victim != NO_VICTIM && (c->prefetched[i] & bit)) {
+        c->prefetcher->useless++;
+    }
+    c->prefetched[i] = prefetched ? c->prefetched[i] | bit : c->prefetched[i] & ~bit;
+}
+
+/*
+ * Simulates batch on c under its write mode, a record at a time. A modify is
+ * a load and then a store.
+ */
+static void write_batch(Cache *c, const TraceBatch *batch)
+{
+    for (size_t k = 0; k < batch->count; k++) {
+        char operation = batch->op[k];
+        if (operation == 'L' || operation == 'M') {
+            write_access(c, batch->address[k], batch->size[k], 0);
+        }
+        if (operation == 'S' || operation == 'M') {
+            write_access(c, batch->address[k], batch->size[k], 1);
+        }
+    }
+}
+
+/*
+ * Simulates a load or store of size bytes at address, counting the traffic
+ * to memory it causes. A store of size 0 counts as one of a byte.
+ */
+static void write_access(Cache *c, uint64_t address, uint32_t size, int store)
+{
+    uint64_t i = (address >> c->offset_bit_count) & (c->set_count - 1);
+    uint64_t block_bytes = (uint64_t) 1 << c->offset_bit_count;
+    int way = level_probe(c, address);
+    if (store && (c->write_mode & WRITE_THROUGH)) {
+        c->write_bytes += size ? size : 1;
+    }
+    if (way == -1 && store && (c->write_mode & WRITE_NO_ALLOCATE)) {
+        // The store goes around the cache
+        c->misses++;
+        if (c->write_mode & WRITE_BACK) {
+            c->write_bytes += size ? size : 1;
+        }
+        return;
+    }
+    uint64_t victim = level_access(c, address);
+    if (way == -1) {
+        c->read_bytes += block_bytes;
+        way = level_probe(c, address);
+        uint64_t bit = (uint64_t) 1 << way;
+        if (victim != NO_VICTIM && (c->dirty[i] & bit)) {
+            c->dirty_evictions++;
+            c->write_bytes += block_bytes;
+        }
+        c->dirty[i] &= ~bit;
+    }
+    if (store && (c->write_mode & WRITE_BACK)) {
+        c->dirty[i] |= (uint64_t) 1 << way;
+    }
+}
+
+#ifndef CSIM_LIBRARY
+/*
+ * Simulates batch on the private caches of core_count cores, each record on
+ * the cache of its core. A modify is a load and then a store.
+ */
+static void coherence_batch(Cache *cores, int core_count, const TraceBatch *batch)
+{
+    for (size_t k = 0; k < batch->count; k++) {
+        char operation = batch->op[k];
+        if (operation == 'L' || operation == 'M') {
+            coherence_access(cores, core_count, batch->core[k], batch->address[k], 0);
+        }
+        if (operation == 'S' || operation == 'M') {
+            coherence_access(cores, core_count, batch->core[k], batch->address[k], 1);
+        }
+    }
+}
+
+/*
+ * Simulates a load or store to address by core, snooping the caches of the
+ * other cores whenever it misses or has to gain ownership of a shared line.
+ * Under MOESI a modified line that another core reads becomes owned and keeps
+ * supplying the data; under MESI it is written back and becomes shared.
+ */
+static void coherence_access(Cache *cores, int core_count, int core, uint64_t address, int store)
+{
+    Cache *c = &cores[core];
+    uint64_t block = address >> c->offset_bit_count;
+    uint64_t i = block & (c->set_count - 1);
+    uint64_t tag = block & ~(c->set_count - 1);
+    uint8_t *states = c->coherence + i * c->soa_stride;
+    int way = level_probe(c, address);
+    int state = way == -1 ? COHERENCE_INVALID : states[way];
+    if (way != -1 && (!store || state == COHERENCE_MODIFIED || state == COHERENCE_EXCLUSIVE)) {
+        level_access(c, address);
+        if (store) {
+            states[way] = COHERENCE_MODIFIED;
+        }
+        return;
+    }
+    if (way == -1 && c->soa_holes && lost_tag(c, i, tag)) {
+        c->coherence_misses++;
+    }
+
+    int shared = 0;
+    for (int k = 0; k < core_count; k++) {
+        Cache *other = &cores[k];
+        int other_way = k == core ? -1 : level_probe(other, address);
+        if (other_way == -1) {
+            continue;
+        }
+        uint8_t *other_state = &other->coherence[i * other->soa_stride + other_way];
+        if (way == -1 && (*other_state == COHERENCE_MODIFIED || *other_state == COHERENCE_OWNED)) {
+            other->interventions++;
+        }
+        if (store) {
+            // The dirty data, if any, moves to the writer with ownership
+            other->lost_tags[i * other->soa_stride + other_way] = tag;
+            level_invalidate(other, address);
+            *other_state = COHERENCE_INVALID;
+            other->invalidations++;
+            continue;
+        }
+        shared = 1;
+        if (*other_state == COHERENCE_MODIFIED && c->protocol == PROTOCOL_MOESI) {
+            *other_state = COHERENCE_OWNED;
+        }
+        else if (*other_state == COHERENCE_MODIFIED) {
+            other->writebacks++;
+            *other_state = COHERENCE_SHARED;
+        }
+        else if (*other_state == COHERENCE_EXCLUSIVE) {
+            *other_state = COHERENCE_SHARED;
+        }
+    }
+    if (way != -1) {
+        c->upgrades++;
+        level_access(c, address);
+        states[way] = COHERENCE_MODIFIED;
+        return;
+    }
+    uint64_t victim = level_access(c, address);
+    way = level_probe(c, address);
+    if (victim != NO_VICTIM
+        && (states[way] == COHERENCE_MODIFIED || states[way] == COHERENCE_OWNED)) {
+        c->writebacks++;
+    }
+    states[way] = store ? COHERENCE_MODIFIED
+                  : shared ? COHERENCE_SHARED : COHERENCE_EXCLUSIVE;
+}
+
+/*
+ * Returns 1 if an invalidated way of set i of c lost tag.
+ */
+static int lost_tag(const Cache *c, uint64_t i, uint64_t tag)
+{
+    const uint64_t *tags = c->soa_tags + i * c->soa_stride;
+    int size = c->soa_size[i];
+    uint64_t valid = size == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << size) - 1;
+    uint64_t holes = soa_match(tags, c->soa_stride, SOA_HOLE) & valid;
+    while (holes != 0) {
+        int way = __builtin_ctzll(holes);
+        if (c->lost_tags[i * c->soa_stride + way] == tag) {
+            return 1;
+        }
+        holes &= holes - 1;
+    }
+    return 0;
+}
+
+static void simulate_hierarchy_batch(const Hierarchy *h, const TraceBatch *batch)
+{
+    for (size_t k = 0; k < batch->count; k++) {
+        char operation = batch->op[k];
+        Cache *first = operation == 'I' ? h->l1i : h->l1d;
+        int count = operation == 'M' ? 2 : 1;
+        if (first == NULL) {
+            continue;
+        }
+        // Split accesses at the blocks of the first level, as misses reach
+        // lower levels a block of the first level at a time anyway
+        int bits = first->offset_bit_count;
+        uint64_t address = batch->address[k];
+        uint64_t span = h->split_lines ? block_span(address, batch->size[k], bits) : 1;
+        for (uint64_t j = 0; j < span; j++) {
+            uint64_t part = j == 0 ? address : ((address >> bits) + j) << bits;
+            for (int n = 0; n < count; n++) {
+                hierarchy_access(h, first, part);
+            }
+        }
+    }
+}
+#endif
+
+/*
+ * Returns a bitmask of the ways in the stride tags starting at tags that equal
+ * tag. The caller masks off invalid ways.
+ */
+static uint64_t soa_match(const uint64_t *tags, uint64_t stride, uint64_t tag)
+{
+    uint64_t match = 0;
+#if defined(__AVX512F__) && !defined(CSIM_NO_SIMD)
+    __m512i needle = _mm512_set1_epi64(tag);
+    for (uint64_t j = 0; j < stride; j += 8) {
+        __m512i v = _mm512_load_si512((const void *) (tags + j));
+        match |= (uint64_t) _mm512_cmpeq_epi64_mask(v, needle) << j;
+    }
+#elif defined(__AVX2__) && !defined(CSIM_NO_SIMD)
+    __m256i needle = _mm256_set1_epi64x(tag);
+    for (uint64_t j = 0; j < stride; j += 4) {
+        __m256i v = _mm256_load_si256((const __m256i *) (tags + j));
+        __m256d eq = _mm256_castsi256_pd(_mm256_cmpeq_epi64(v, needle));
+        match |= (uint64_t) _mm256_movemask_pd(eq) << j;
+    }
+#else
+    for (uint64_t j = 0; j < stride; j++) {
+        match |= (uint64_t) (tags[j] == tag) << j;
+    }
+#endif
+    return match;
+}
+
+/*
+ * This is O(N), where N = lines per set. The hash engine replaces it with a
+ * hashmap that maps from tag to CacheLine; see hash_index.
+ *
+ * Adds the number of lines it compared to *probes.
+ */
+static CacheLine *find(CacheSet *set, uint64_t tag, uint64_t *probes)
+{
+    CacheLine *l = set->lru;
+    uint64_t n = 0;
+    while (l != NULL) {
+        n++;
+        if (l->tag == tag) {
+            *probes += n;
+            return l;
+        }
+        l = l->next;
+    }
+    *probes += n;
+    return NULL;
+}
+
+// Does not release the line; the caller may reuse it
+static CacheLine *evict(CacheSet *set, CacheLine *line)
+{
+    if (set->lru == line) {
+        set->lru = line->next;
+    }
+    if (set->mru == line) {
+        set->mru = line->prev;
+    }
+    if (line->prev != NULL) {
+        line->prev->next = line->next;
+    }
+    if (line->next != NULL) {
+        line->next->prev = line->prev;
+    }
+    set->size--;
+    return line;
+}
+
+/*
+ * Makes line into the most recently used CacheLine in set.
+ *
+ * Note: overwrites line->prev and line->next.
+ */
+static CacheLine *push(CacheSet *set, CacheLine *line)
+{
+    if (set->mru == NULL) {
+        // First time
+        line->prev = NULL;
+        line->next = NULL;
+        set->lru = line;
+        set->mru = line;
+    }
+    else {
+        set->mru->next = line;
+        line->prev = set->mru;
+        line->next = NULL;
+        set->mru = line;
+    }
+    set->size++;
+    return line;
+}
+
+#ifndef CSIM_LIBRARY
+static uint64_t convert_hex_string(char *string)
+{
+    uint64_t res = 0;
+    for (int i = 0; i < strlen(string); i++) {
+        uint64_t d = convert_hex_digit(string[strlen(string)-i-1]);
+        res += d * 1<<(4*i);
+    }
+    return res;
+}
+
+static int convert_hex_digit(char digit)
+{
+    if (digit >= '0' && digit <= '9') {
+        return digit-'0';
+    }
+    if (digit >= 'a' && digit <= 'f') {
+        return digit-'a' + 10;
+    }
+    if (digit >= 'A' && digit <= 'F') {
+        return digit-'A' + 10;
+    }
+    return -1; // BAD
+}
+
+/*
+ * The trace tokenizer works on 64-byte windows. byte_mask64 returns a bitmask
+ * with bit i set when p[i] == c, using AVX2 or SSE2 when the compiler targets
+ * them (building with -DCSIM_NO_SIMD forces the scalar loop). Newline and comma
+ * masks of the same window give every line boundary and every address span in
+ * it without looking at the bytes one at a time.
+ */
+static inline uint64_t byte_mask64(const char *p, char c)
+{
+#if defined(__AVX2__) && !defined(CSIM_NO_SIMD)
+    __m256i needle = _mm256_set1_epi8(c);
+    __m256i lo = _mm256_loadu_si256((const __m256i *) p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *) (p + 32));
+    uint64_t lo_mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle));
+    uint64_t hi_mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle));
+    return hi_mask << 32 | lo_mask;
+#elif defined(__SSE2__) && !defined(CSIM_NO_SIMD)
+    __m128i needle = _mm_set1_epi8(c);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + 16*i));
+        uint64_t m = (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        mask |= m << (16*i);
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i++) {
+        mask |= (uint64_t) (p[i] == c) << i;
+    }
+    return mask;
+#endif
+}
+
+/*
+ * Tokenizes complete lines from [p, end) into batch until the batch is full or
+ * no complete line is left. Returns a pointer to the first byte not consumed,
+ * which is either end or the start of a line without a terminating newline.
  */
-typedef struct CacheLine {
-    uint64_t tag;
-    struct CacheLine *prev;
-    struct CacheLine *next;
-} CacheLine;
+static const char *tokenize_trace(const char *p, const char *end, TraceBatch *batch)
+{
+    while (batch->count < BATCH_CAPACITY && end - p >= 64) {
+        uint64_t newlines = byte_mask64(p, '\n');
+        if (newlines == 0) {
+            // A line longer than the window: take just that one the slow way
+            const char *newline = memchr(p + 64, '\n', end - p - 64);
+            if (newline == NULL) {
+                break;
+            }
+            const char *comma = memchr(p, ',', newline - p);
+            p = tokenize_line(p, comma ? comma : newline, newline, end, batch);
+            continue;
+        }
+        uint64_t commas = byte_mask64(p, ',');
+        int start = 0;
+        while (newlines != 0 && batch->count < BATCH_CAPACITY) {
+            int newline = __builtin_ctzll(newlines);
+            uint64_t line_commas = commas & ~(~(uint64_t) 0 << newline)
+                                          & (~(uint64_t) 0 << start);
+            int comma = line_commas ? __builtin_ctzll(line_commas) : newline;
+            tokenize_line(p + start, p + comma, p + newline, end, batch);
+            start = newline + 1;
+            newlines &= newlines - 1;
+        }
+        p += start;
+    }
+    while (batch->count < BATCH_CAPACITY && p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        if (newline == NULL) {
+            break;
+        }
+        const char *comma = memchr(p, ',', newline - p);
+        p = tokenize_line(p, comma ? comma : newline, newline, end, batch);
+    }
+    return p;
+}
 
 /*
- * A CacheSet contains pointers to the least recently used (lru) and most
- * recently used (mru) CacheLine. The lru and mru are the tail and head,
- * respectively, of a doubly linked list which represents all CacheLines
- * currently in the CacheSet. The doubly linked list is always kept in a sorted
- * order, with the less recently used CacheLines towards the tail.
- *
- * A CacheSet keeps track of its size in order to determine when it has become
- * full.
+ * Decodes one line whose comma (or newline, if it has none) and newline have
+ * already been located, appending it to batch if it is an 'L', 'S', 'M', or
+ * 'I' record. Returns a pointer to the start of the next line.
  */
-typedef struct CacheSet {
-    int size;
-    CacheLine *lru;
-    CacheLine *mru;
-} CacheSet;
+static const char *tokenize_line(const char *line, const char *comma,
+                                 const char *newline, const char *end,
+                                 TraceBatch *batch)
+{
+    const char *p = line;
+    while (p < comma && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    if (p == comma || (*p != 'L' && *p != 'S' && *p != 'M' && *p != 'I')) {
+        return newline + 1;
+    }
+    char operation = *p++;
+    while (p < comma && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    uint32_t size = 0;
+    for (const char *q = comma + 1; q < newline && *q >= '0' && *q <= '9'; q++) {
+        size = size * 10 + (*q - '0');
+    }
+    size_t n = batch->count++;
+    batch->op[n] = operation;
+    batch->address[n] = decode_hex_span(p, comma, end);
+    batch->size[n] = size;
+    return newline + 1;
+}
 
-int convert_hex_digit(char digit);
-int initialize();
-uint64_t convert_hex_string(char *string);
-void cleanup();
-void simulate_single_access(CacheSet *curr_set, uint64_t tag);
-void simulate_operation(char *trace_line);
-CacheLine *find(CacheSet *set, uint64_t tag);
-CacheLine *evict(CacheSet *set, CacheLine *line);
-CacheLine *push(CacheSet *set, CacheLine *line);
+static inline uint64_t load64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-#define BUFFER_SIZE 100
+/*
+ * Converts up to 8 hex characters, packed little-endian into v with the most
+ * significant digit in the lowest byte, into their value. Zero bytes count as
+ * leading zeros. Each byte becomes a nibble with (c & 0xf) + 9 * (c has bit 6),
+ * which is right for '0'-'9', 'a'-'f', and 'A'-'F', and then neighboring
+ * nibbles, bytes, and halfwords are merged.
+ */
+static inline uint64_t swar_hex8(uint64_t v)
+{
+    v = (v & 0x0f0f0f0f0f0f0f0f) + 9 * ((v >> 6) & 0x0101010101010101);
+    v = ((v & 0x000f000f000f000f) << 4) | ((v >> 8) & 0x000f000f000f000f);
+    v = ((v & 0x000000ff000000ff) << 8) | ((v >> 16) & 0x000000ff000000ff);
+    v = ((v & 0x000000000000ffff) << 16) | ((v >> 32) & 0x000000000000ffff);
+    return v;
+}
 
-int set_bit_count = 0;
-int lines_per_set = 0;
-int offset_bit_count = 0;
+/*
+ * One plus the value of each hex digit, and 0 for every other character.
+ */
+static const uint8_t hex_value[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
 
 /*
- * A cache is an array of set_count CacheSets.
+ * Decodes the hex digits in [p, q). Spans of 1 to 16 digits with 16 readable
+ * bytes behind them go through swar_hex8; anything else (the last few bytes of
+ * the input, or a malformed span) falls back to the table, which stops at the
+ * first non-hex character.
  */
-CacheSet *cache;
-uint64_t set_count;
+static uint64_t decode_hex_span(const char *p, const char *q, const char *end)
+{
+    size_t length = q - p;
+    if (length >= 1 && length <= 16 && end - p >= 16) {
+        if (length <= 8) {
+            return swar_hex8(load64(p) << (8 * (8 - length)));
+        }
+        uint64_t hi = swar_hex8(load64(p) << (8 * (16 - length)));
+        return hi << 32 | swar_hex8(load64(p + length - 8));
+    }
+    uint64_t res = 0;
+    for (; p < q && hex_value[(unsigned char) *p] != 0; p++) {
+        res = res << 4 | (hex_value[(unsigned char) *p] - 1);
+    }
+    return res;
+}
 
-int hits = 0;
-int misses = 0;
-int evictions = 0;
+static double seconds_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
 /*
- * You must specify the following as command-line arguments: number of bits used
- * for the set index, number of lines per set, number of bits used for the
- * offset, path to a valgrind memory trace.
+ * csim parsebench -t <trace> [-r <repetitions>]
+ *
+ * Parses a trace without simulating it, first line by line with
+ * parse_operation (the sscanf path) and then with tokenize_trace, and reports
+ * the throughput of each. The checksums must agree.
  */
-int main(int argc, char* argv[])
+static int parse_benchmark(int argc, char *argv[])
 {
     int opt;
     char *t = NULL;
-
-    while ((opt = getopt(argc, argv, "s:E:b:t:")) != -1) {
+    int repetitions = 3;
+    while ((opt = getopt(argc, argv, "t:r:")) != -1) {
         switch (opt) {
-        case 's':
-            set_bit_count = atoi(optarg);
-            break;
-        case 'E':
-            lines_per_set = atoi(optarg);
-            break;
-        case 'b':
-            offset_bit_count = atoi(optarg);
-            break;
         case 't':
-            t = malloc(strlen(optarg));
-            memcpy(t, optarg, strlen(optarg)+1);
+            t = optarg;
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
             break;
         default:
             break;
         }
     }
-    if (set_bit_count <= 0 || lines_per_set <= 0 || offset_bit_count <= 0 || t == NULL) {
-        printf("Bad arguments\n");
-        return 1;
-    }
-    if (set_bit_count >= 64 || offset_bit_count >= 64) {
+    int fd;
+    struct stat st;
+    if (t == NULL || repetitions <= 0) {
         printf("Bad arguments\n");
         return 1;
     }
-    // Guaranteed no overflow
-    set_count = (uint64_t) 1 << set_bit_count;
-
-    FILE *file;
-    char trace_line[BUFFER_SIZE + 1];
-    if ((file = fopen(t, "r")) == NULL) {
+    if ((fd = open(t, O_RDONLY)) == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
         printf("Bad file\n");
         return 1;
     }
-
-    if (initialize() == 1) {
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    TraceBatch *batch = malloc(sizeof(TraceBatch));
+    if (data == MAP_FAILED || batch == NULL) {
         printf("Bad initialize\n");
         return 1;
     }
-    while (fgets(trace_line, BUFFER_SIZE, file) != NULL) {
-        if (strlen(trace_line) == 0 || trace_line[strlen(trace_line)-1] != '\n') {
-            printf("Bad input\n");
-            cleanup();
-            return 1;
+    const char *end = data + st.st_size;
+
+    for (int r = 0; r < repetitions; r++) {
+        uint64_t records = 0;
+        uint64_t checksum = 0;
+        char trace_line[BUFFER_SIZE + 1];
+        double start = seconds_now();
+        for (const char *p = data; p < end; ) {
+            const char *newline = memchr(p, '\n', end - p);
+            size_t length = (newline ? newline + 1 : end) - p;
+            if (length > BUFFER_SIZE) {
+                length = BUFFER_SIZE;
+            }
+            memcpy(trace_line, p, length);
+            trace_line[length] = '\0';
+            p += length;
+            char operation;
+            uint64_t address;
+            parse_operation(trace_line, &operation, &address);
+            if (operation == 'L' || operation == 'S' || operation == 'M' || operation == 'I') {
+                records++;
+                checksum += address;
+            }
         }
-        simulate_operation(trace_line);
-    }
-    cleanup();
-    fclose(file);
+        double sscanf_time = seconds_now() - start;
 
-    // printSummary(hits, misses, evictions);
-    printf("hits:%d misses:%d evictions:%d\n", hits, misses, evictions);
+        uint64_t tokenized_records = 0;
+        uint64_t tokenized_checksum = 0;
+        start = seconds_now();
+        for (const char *p = data; p < end; ) {
+            batch->count = 0;
+            const char *next = tokenize_trace(p, end, batch);
+            for (size_t i = 0; i < batch->count; i++) {
+                tokenized_checksum += batch->address[i];
+            }
+            tokenized_records += batch->count;
+            if (next == p) {
+                break;
+            }
+            p = next;
+        }
+        double tokenize_time = seconds_now() - start;
 
+        double mb = st.st_size / 1e6;
+        printf("sscanf:   %8.1f MB/s %12.0f records/s\n",
+               mb / sscanf_time, records / sscanf_time);
+        printf("tokenize: %8.1f MB/s %12.0f records/s (%.1fx)\n",
+               mb / tokenize_time, tokenized_records / tokenize_time,
+               sscanf_time / tokenize_time);
+        if (records != tokenized_records || checksum != tokenized_checksum) {
+            printf("Checksum mismatch\n");
+            return 1;
+        }
+    }
+    free(batch);
+    munmap(data, st.st_size);
+    close(fd);
     return 0;
 }
 
-int initialize()
+/*
+ * csim bench [-n <records>] [-w <working set bytes>] [-p <patterns>]
+ *            [-m <sweep spec>] [-r <repetitions>]
+ *
+ * Generates a synthetic trace of each of the comma-separated patterns (by
+ * default all of BENCH_PATTERNS; see generate_trace), then reports how fast
+ * tokenize_trace parses its text form and how fast every engine simulates it
+ * on every geometry of the matrix (BENCH_MATRIX by default), as records/s and
+ * ns per access. Each figure is the best of the repetitions.
+ */
+static int run_benchmark(int argc, char *argv[])
 {
-    uint64_t bytes_to_allocate = sizeof(CacheSet) * set_count;
-    if (bytes_to_allocate / set_count != sizeof(CacheSet)) {
-        return 1; // Overflow
+    int opt;
+    long records = 1 << 20;
+    long working_set = 1 << 24;
+    char patterns[256] = BENCH_PATTERNS;
+    char matrix[256] = BENCH_MATRIX;
+    int repetitions = 3;
+    while ((opt = getopt(argc, argv, "n:w:p:m:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            records = atol(optarg);
+            break;
+        case 'w':
+            working_set = atol(optarg);
+            break;
+        case 'p':
+            snprintf(patterns, sizeof(patterns), "%s", optarg);
+            break;
+        case 'm':
+            snprintf(matrix, sizeof(matrix), "%s", optarg);
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            break;
+        default:
+            break;
+        }
     }
-    cache = malloc(bytes_to_allocate);
-    if (cache == NULL) {
+    Cache base = {0};
+    base.prefetch_distance = PREFETCH_DISTANCE;
+    Cache *caches;
+    int cache_count;
+    if (records <= 0 || working_set < 64 || repetitions <= 0
+        || parse_sweep(matrix, &base, &caches, &cache_count) == 1) {
+        printf("Bad arguments\n");
+        return 1;
+    }
+    size_t batch_count = (records + BATCH_CAPACITY - 1) / BATCH_CAPACITY;
+    TraceBatch *batches = malloc(batch_count * sizeof(TraceBatch));
+    // A text record is at most " M " + 16 digits + "," + 2 digits + "\n"
+    char *text = malloc((size_t) batch_count * BATCH_CAPACITY * 24);
+    TraceBatch *parsed = malloc(sizeof(TraceBatch));
+    if (batches == NULL || text == NULL || parsed == NULL) {
+        printf("Bad initialize\n");
         return 1;
     }
-    memset(cache, 0, bytes_to_allocate);
-    return 0;
-}
 
-void cleanup()
-{
-    for (uint64_t i = 0; i < set_count; i++) {
-        CacheLine *cl = cache[i].lru;
-        while (cl != NULL) {
-            CacheLine *tmp = cl->next;
-            free(cl);
-            cl = tmp;
+    static const Engine engines[] = {ENGINE_LIST, ENGINE_HASH, ENGINE_SOA, ENGINE_STACK};
+    static const char *const engine_names[] = {"list", "hash", "soa", "stack"};
+    char *save;
+    for (char *pattern = strtok_r(patterns, ",", &save); pattern != NULL;
+         pattern = strtok_r(NULL, ",", &save)) {
+        if (generate_trace(pattern, working_set, batches, batch_count) == 1) {
+            printf("Bad arguments\n");
+            return 1;
+        }
+        batches[batch_count - 1].count = records - (batch_count - 1) * BATCH_CAPACITY;
+
+        char *p = text;
+        for (size_t k = 0; k < batch_count; k++) {
+            for (size_t i = 0; i < batches[k].count; i++) {
+                p += sprintf(p, " %c %" PRIx64 ",%" PRIu32 "\n", batches[k].op[i],
+                             batches[k].address[i], batches[k].size[i]);
+            }
+        }
+        const char *end = p;
+        double best = 0;
+        for (int r = 0; r < repetitions; r++) {
+            double start = seconds_now();
+            for (const char *q = text; q < end; ) {
+                parsed->count = 0;
+                q = tokenize_trace(q, end, parsed);
+            }
+            double elapsed = seconds_now() - start;
+            best = r == 0 || elapsed < best ? elapsed : best;
+        }
+        printf("pattern:%s parse MB/s:%.1f records/s:%.0f\n",
+               pattern, (end - text) / best / 1e6, records / best);
+
+        for (int k = 0; k < cache_count; k++) {
+            for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+                Cache c = caches[k];
+                c.engine = engines[e];
+                if (check_config(&c) == 1) {
+                    continue;
+                }
+                best = 0;
+                uint64_t accesses = 0;
+                uint64_t misses = 0;
+                for (int r = 0; r < repetitions; r++) {
+                    Cache run = c;
+                    if (initialize(&run) == 1) {
+                        printf("Bad initialize\n");
+                        return 1;
+                    }
+                    double start = seconds_now();
+                    for (size_t b = 0; b < batch_count; b++) {
+                        simulate_batch(&run, &batches[b]);
+                    }
+                    double elapsed = seconds_now() - start;
+                    best = r == 0 || elapsed < best ? elapsed : best;
+                    accesses = run.hits + run.misses;
+                    misses = run.misses;
+                    cleanup(&run);
+                }
+                printf("pattern:%s s:%d E:%d b:%d engine:%s records/s:%.0f"
+                       " ns/access:%.2f miss_ratio:%.4f\n",
+                       pattern, c.set_bit_count, c.lines_per_set, c.offset_bit_count,
+                       engine_names[e], records / best,
+                       accesses ? best * 1e9 / accesses : 0.0,
+                       accesses ? (double) misses / accesses : 0.0);
+            }
         }
     }
-    free(cache);
+    free(parsed);
+    free(text);
+    free(batches);
+    free(caches);
+    return 0;
 }
 
 /*
- * A line of a valgrind memory trace may begin with characters 'L', 'S', 'M', or
- * 'I'. These characters represents data load, data store, data modify, and
- * instruction load, respectively. We only consider 'L', 'S', and 'M'.
- *
- * For the purposes of this simulator, 'M' is equivalent to 'L' and then 'S',
- * and 'L' and 'S' are equivalent.
+ * csim verify [-t <trace>]... [-n <records>] [-w <working set bytes>]
+ *             [-p <patterns>] [-m <sweep spec>] [-j <workers>] [-r <repetitions>]
  *
- * A line of a valgrind memory trace also contains an address. This address is
- * parsed in order to determine which CacheSet it corresponds to, and which tag
- * should be searched for in that CacheSet.
+ * Checks that every engine (list, hash, soa, stack) alone, split between
+ * -j workers (VERIFY_WORKERS by default), and list with --dedup gives
+ * exactly the hits, misses, and evictions of the list engine on one thread,
+ * the reference. For stack it also checks every point of the miss ratio
+ * curve, from 1 line per set up to E, against the list engine run with that
+ * many lines, and prints a line for each point that differs. It does this for
+ * every geometry of the matrix (BENCH_MATRIX
+ * by default) on a synthetic trace of each pattern, as csim bench makes them
+ * ("none" for no patterns), and on each -t trace. For each run it prints the
+ * counters, the best time of the repetitions as records/s, and the speedup
+ * over the reference. Returns 1 if any run differs.
  */
-void simulate_operation(char *trace_line)
+static int run_verify(int argc, char *argv[])
 {
-    char tmp1[2];
-    char tmp2[20];
-    sscanf(trace_line, "%s %[^,]s,%*s", tmp1, tmp2);
-
-    char operation = tmp1[0];
-    uint64_t address = convert_hex_string(tmp2);
-    address >>= offset_bit_count; // Don't care about offset
-    
-    // printf("%" PRIx64 "\n", ~0 << (uint64_t) 32); // Raises warning
-    uint64_t mask = (uint64_t) ~0 << set_bit_count;
-    uint64_t tag = address & mask;
-    uint64_t i = address & ~mask;
-    CacheSet *curr_set = cache + i;
-
-    switch (operation) {
-    case 'L':
-    case 'S':
-        simulate_single_access(curr_set, tag);
-        break;
-    case 'M':
-        simulate_single_access(curr_set, tag);
-        simulate_single_access(curr_set, tag);
-        break;
-    default:
-        break;
+    int opt;
+    long records = 1 << 20;
+    long working_set = 1 << 24;
+    char patterns[256] = BENCH_PATTERNS;
+    char matrix[256] = BENCH_MATRIX;
+    int worker_count = VERIFY_WORKERS;
+    int repetitions = 1;
+    char *traces[MAX_CORES];
+    int trace_count = 0;
+    while ((opt = getopt(argc, argv, "t:n:w:p:m:j:r:")) != -1) {
+        switch (opt) {
+        case 't':
+            if (trace_count == MAX_CORES) {
+                printf("Bad arguments\n");
+                return 1;
+            }
+            traces[trace_count++] = optarg;
+            break;
+        case 'n':
+            records = atol(optarg);
+            break;
+        case 'w':
+            working_set = atol(optarg);
+            break;
+        case 'p':
+            snprintf(patterns, sizeof(patterns), "%s", optarg);
+            break;
+        case 'm':
+            snprintf(matrix, sizeof(matrix), "%s", optarg);
+            break;
+        case 'j':
+            worker_count = atoi(optarg);
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            break;
+        default:
+            break;
+        }
     }
+    Cache base = {0};
+    base.prefetch_distance = PREFETCH_DISTANCE;
+    base.sample_period = 1;
+    Cache *caches;
+    int cache_count;
+    if (records <= 0 || working_set < 64 || repetitions <= 0
+        || worker_count < 2 || worker_count > MAX_WORKERS
+        || parse_sweep(matrix, &base, &caches, &cache_count) == 1) {
+        printf("Bad arguments\n");
+        return 1;
+    }
+    int mismatches = 0;
+    int runs = 0;
+    char *save;
+    for (char *pattern = strtok_r(patterns, ",", &save);
+         pattern != NULL && strcmp(pattern, "none") != 0; pattern = strtok_r(NULL, ",", &save)) {
+        size_t batch_count = (records + BATCH_CAPACITY - 1) / BATCH_CAPACITY;
+        TraceBatch *batches = malloc(batch_count * sizeof(TraceBatch));
+        if (batches == NULL) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+        if (generate_trace(pattern, working_set, batches, batch_count) == 1) {
+            printf("Bad arguments\n");
+            return 1;
+        }
+        batches[batch_count - 1].count = records - (batch_count - 1) * BATCH_CAPACITY;
+        int status = verify_trace(pattern, caches, cache_count, batches, batch_count,
+                                  worker_count, repetitions, &mismatches);
+        free(batches);
+        if (status == -1) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+        runs += status;
+    }
+    for (int k = 0; k < trace_count; k++) {
+        TraceBatch *batches;
+        size_t batch_count;
+        int status = load_trace(traces[k], &batches, &batch_count);
+        if (status != 0) {
+            printf(status == -1 ? "Bad file\n" : "Bad input\n");
+            return 1;
+        }
+        status = verify_trace(traces[k], caches, cache_count, batches, batch_count,
+                              worker_count, repetitions, &mismatches);
+        free(batches);
+        if (status == -1) {
+            printf("Bad initialize\n");
+            return 1;
+        }
+        runs += status;
+    }
+    free(caches);
+    printf("verify runs:%d mismatches:%d\n", runs, mismatches);
+    return mismatches > 0;
 }
 
-void simulate_single_access(CacheSet *curr_set, uint64_t tag)
+/*
+ * Runs the checks of csim verify on the trace in batches, called name, and
+ * adds the runs that differ from the reference to *mismatches. Returns the
+ * number of runs, or -1 if a cache cannot be initialized.
+ */
+static int verify_trace(const char *name, const Cache *caches, int cache_count,
+                        const TraceBatch *batches, size_t batch_count, int worker_count,
+                        int repetitions, int *mismatches)
 {
-    CacheLine *match = find(curr_set, tag);
-    if (match == NULL) {
-        // Miss
-        misses++;
-        CacheLine *new_line = malloc(sizeof(CacheLine));
-        new_line->tag = tag;
-        if (curr_set->size >= lines_per_set) {
-            // Eviction
-            evictions++;
-            CacheLine *evicted = evict(curr_set, curr_set->lru);
-            free(evicted);
-        }
-        push(curr_set, new_line);
+    static const Engine engines[] = {ENGINE_LIST, ENGINE_HASH, ENGINE_SOA, ENGINE_STACK};
+    static const char *const engine_names[] = {"list", "hash", "soa", "stack"};
+    int engine_total = sizeof(engines) / sizeof(engines[0]);
+    uint64_t records = 0;
+    for (size_t b = 0; b < batch_count; b++) {
+        records += batches[b].count;
     }
-    else {
-        // Hit
-        hits++;
-        evict(curr_set, match);
-        push(curr_set, match);
+    int runs = 0;
+    for (int k = 0; k < cache_count; k++) {
+        Counters reference = {0};
+        double reference_time = 0;
+        // The list counters at each number of lines, filled in for stack
+        Counters *curve_reference = NULL;
+        // Each engine on one thread and on the workers, then list with --dedup
+        for (int v = 0; v < 2 * engine_total + 1; v++) {
+            Cache c = caches[k];
+            c.engine = engines[v < 2 * engine_total ? v / 2 : 0];
+            c.dedup = v == 2 * engine_total;
+            int workers = v < 2 * engine_total && v % 2 == 1 ? worker_count : 1;
+            if (check_config(&c) == 1) {
+                continue;
+            }
+            double best = 0;
+            Counters counters = {0};
+            Counters *curve = NULL;
+            if (c.engine == ENGINE_STACK) {
+                curve = malloc(c.lines_per_set * sizeof(Counters));
+                if (curve == NULL) {
+                    free(curve_reference);
+                    return -1;
+                }
+            }
+            for (int r = 0; r < repetitions; r++) {
+                Cache run = c;
+                Simulation sim = {
+                    .caches = &run,
+                    .cache_count = 1,
+                    .worker_count = workers,
+                    .parser_count = 1,
+                };
+                if (initialize(&run) == 1 || start_workers(&sim) == 1) {
+                    free(curve);
+                    free(curve_reference);
+                    return -1;
+                }
+                double start = seconds_now();
+                for (size_t b = 0; b < batch_count; b++) {
+                    dispatch_batch(&sim, &batches[b]);
+                }
+                finish_workers(&sim);
+                double elapsed = seconds_now() - start;
+                best = r == 0 || elapsed < best ? elapsed : best;
+                if (run.engine == ENGINE_STACK) {
+                    for (int e = 1; e <= run.lines_per_set; e++) {
+                        stack_counters(&run, e, &curve[e - 1].hits, &curve[e - 1].misses,
+                                       &curve[e - 1].evictions);
+                    }
+                    counters = curve[run.lines_per_set - 1];
+                }
+                else {
+                    counters = (Counters) {run.hits, run.misses, run.evictions};
+                }
+                workers = sim.worker_count;
+                cleanup(&run);
+            }
+            if (v == 0) {
+                reference = counters;
+                reference_time = best;
+            }
+            int match = counters.hits == reference.hits && counters.misses == reference.misses
+                        && counters.evictions == reference.evictions;
+            if (curve != NULL && curve_reference == NULL) {
+                curve_reference = malloc(c.lines_per_set * sizeof(Counters));
+                for (int e = 1; curve_reference != NULL && e < c.lines_per_set; e++) {
+                    if (list_counters(&c, e, batches, batch_count, &curve_reference[e - 1]) == 1) {
+                        free(curve_reference);
+                        curve_reference = NULL;
+                    }
+                }
+                if (curve_reference == NULL) {
+                    free(curve);
+                    return -1;
+                }
+                curve_reference[c.lines_per_set - 1] = reference;
+            }
+            for (int e = 1; curve != NULL && e <= c.lines_per_set; e++) {
+                const Counters *got = &curve[e - 1];
+                const Counters *want = &curve_reference[e - 1];
+                if (got->hits != want->hits || got->misses != want->misses
+                    || got->evictions != want->evictions) {
+                    match = 0;
+                    printf("trace:%s s:%d E:%d b:%d engine:stack workers:%d curve E:%d"
+                           " hits:%" PRIu64 " misses:%" PRIu64 " evictions:%" PRIu64
+                           " list hits:%" PRIu64 " misses:%" PRIu64 " evictions:%" PRIu64
+                           " MISMATCH\n",
+                           name, c.set_bit_count, c.lines_per_set, c.offset_bit_count, workers, e,
+                           got->hits, got->misses, got->evictions,
+                           want->hits, want->misses, want->evictions);
+                }
+            }
+            free(curve);
+            *mismatches += !match;
+            runs++;
+            printf("trace:%s s:%d E:%d b:%d engine:%s%s workers:%d hits:%" PRIu64
+                   " misses:%" PRIu64 " evictions:%" PRIu64 " records/s:%.0f speedup:%.2f %s\n",
+                   name, c.set_bit_count, c.lines_per_set, c.offset_bit_count,
+                   engine_names[v < 2 * engine_total ? v / 2 : 0], c.dedup ? "+dedup" : "",
+                   workers, counters.hits, counters.misses, counters.evictions,
+                   records / best, reference_time / best, match ? "ok" : "MISMATCH");
+        }
+        free(curve_reference);
     }
+    return runs;
 }
 
 /*
- * This is O(N), where N = lines per set. This can be made faster by using a
- * hashmap that maps from tag to CacheLine.
+ * Stores in *counters the counters of the list engine on one thread for the
+ * trace in batches on c with lines lines per set. Returns 1 if the cache
+ * cannot be initialized.
  */
-CacheLine *find(CacheSet *set, uint64_t tag)
+static int list_counters(const Cache *c, int lines, const TraceBatch *batches,
+                         size_t batch_count, Counters *counters)
 {
-    CacheLine *l = set->lru;
-    while (l != NULL) {
-        if (l->tag == tag) {
-            return l;
-        }
-        l = l->next;
+    Cache run = *c;
+    run.engine = ENGINE_LIST;
+    run.dedup = 0;
+    run.lines_per_set = lines;
+    Simulation sim = {
+        .caches = &run,
+        .cache_count = 1,
+        .worker_count = 1,
+        .parser_count = 1,
+    };
+    if (initialize(&run) == 1) {
+        return 1;
     }
-    return NULL;
+    for (size_t b = 0; b < batch_count; b++) {
+        dispatch_batch(&sim, &batches[b]);
+    }
+    *counters = (Counters) {run.hits, run.misses, run.evictions};
+    cleanup(&run);
+    return 0;
 }
 
-// Does not free the line!
-CacheLine *evict(CacheSet *set, CacheLine *line)
+/*
+ * Reads the whole trace at path, text or binary, into a newly allocated array
+ * of *batch_count batches. Returns 0 on success, 1 on malformed input, and -1
+ * if the file cannot be read.
+ */
+static int load_trace(const char *path, TraceBatch **batches, size_t *batch_count)
 {
-    if (set->lru == line) {
-        set->lru = line->next;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
     }
-    if (set->mru == line) {
-        set->mru = line->prev;
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
     }
-    if (line->prev != NULL) {
-        line->prev->next = line->next;
+    const char *p = data;
+    const char *end = data + st.st_size;
+    int binary = st.st_size >= BINARY_MAGIC_BYTES
+                 && memcmp(data, BINARY_MAGIC, BINARY_MAGIC_BYTES) == 0;
+    uint8_t *scratch = binary ? malloc(BLOCK_MAX_RAW_BYTES) : NULL;
+    if (binary) {
+        p += BINARY_MAGIC_BYTES;
     }
-    if (line->next != NULL) {
-        line->next->prev = line->prev;
+    size_t capacity = 0;
+    int status = binary && scratch == NULL ? -1 : 0;
+    *batches = NULL;
+    *batch_count = 0;
+    while (status == 0 && p < end) {
+        if (*batch_count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            TraceBatch *grown = realloc(*batches, capacity * sizeof(TraceBatch));
+            if (grown == NULL) {
+                status = -1;
+                break;
+            }
+            *batches = grown;
+        }
+        TraceBatch *batch = &(*batches)[*batch_count];
+        batch->count = 0;
+        if (binary) {
+            BlockHeader header;
+            if ((size_t) (end - p) < sizeof(header)) {
+                status = 1;
+                break;
+            }
+            memcpy(&header, p, sizeof(header));
+            p += sizeof(header);
+            if ((size_t) (end - p) < header.stored_bytes
+                || decode_block(&header, (const uint8_t *) p, scratch, batch) == 1) {
+                status = 1;
+                break;
+            }
+            p += header.stored_bytes;
+        }
+        else {
+            const char *next = tokenize_trace(p, end, batch);
+            if (next == p) {
+                status = 1; // Trailing line without a newline
+                break;
+            }
+            p = next;
+        }
+        if (batch->count > 0) {
+            (*batch_count)++;
+        }
     }
-    set->size--;
-    return line;
+    free(scratch);
+    munmap(data, st.st_size);
+    if (status != 0) {
+        free(*batches);
+    }
+    return status;
 }
 
 /*
- * Makes line into the most recently used CacheLine in set.
+ * Fills batches with a synthetic trace of the named pattern over working_set
+ * bytes, eight bytes per access, 70% loads, 20% stores, and 10% modifies:
  *
- * Note: overwrites line->prev and line->next.
+ *   stream   walks the working set in order
+ *   stride   walks it BENCH_STRIDE bytes at a time
+ *   uniform  picks each access uniformly at random
+ *   zipf     picks 64-byte blocks with Zipf(BENCH_ZIPF_EXPONENT) popularity,
+ *            with ranks scattered over the working set
+ *   chase    follows a random cycle through all 64-byte blocks, as a linked
+ *            list would
+ *
+ * The pseudo-random sequence is fixed, so every run sees the same trace.
+ * Returns 1 if the pattern is unknown or its tables cannot be allocated.
  */
-CacheLine *push(CacheSet *set, CacheLine *line)
+static int generate_trace(const char *pattern, uint64_t working_set, TraceBatch *batches,
+                          size_t batch_count)
 {
-    if (set->mru == NULL) {
-        // First time
-        line->prev = NULL;
-        line->next = NULL;
-        set->lru = line;
-        set->mru = line;
+    uint64_t seed = 0x2545f4914f6cdd1d;
+    uint64_t block_count = working_set / 64;
+    double *cdf = NULL;
+    uint32_t *next = NULL;
+    int kind;
+    if (strcmp(pattern, "stream") == 0) {
+        kind = 0;
+    }
+    else if (strcmp(pattern, "stride") == 0) {
+        kind = 1;
+    }
+    else if (strcmp(pattern, "uniform") == 0) {
+        kind = 2;
+    }
+    else if (strcmp(pattern, "zipf") == 0) {
+        kind = 3;
+        if (block_count > UINT32_MAX || (cdf = malloc(block_count * sizeof(double))) == NULL) {
+            return 1;
+        }
+        double sum = 0;
+        for (uint64_t j = 0; j < block_count; j++) {
+            sum += 1 / pow(j + 1, BENCH_ZIPF_EXPONENT);
+            cdf[j] = sum;
+        }
+        for (uint64_t j = 0; j < block_count; j++) {
+            cdf[j] /= sum;
+        }
+    }
+    else if (strcmp(pattern, "chase") == 0) {
+        kind = 4;
+        if (block_count > UINT32_MAX || (next = malloc(block_count * sizeof(uint32_t))) == NULL) {
+            return 1;
+        }
+        // Sattolo's algorithm, which yields a single cycle
+        for (uint64_t j = 0; j < block_count; j++) {
+            next[j] = j;
+        }
+        for (uint64_t j = block_count - 1; j > 0; j--) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            uint64_t other = seed % j;
+            uint32_t swap = next[j];
+            next[j] = next[other];
+            next[other] = swap;
+        }
     }
     else {
-        set->mru->next = line;
-        line->prev = set->mru;
-        line->next = NULL;
-        set->mru = line;
+        return 1;
     }
-    set->size++;
-    return line;
+
+    uint64_t position = 0;
+    for (size_t k = 0; k < batch_count; k++) {
+        TraceBatch *batch = &batches[k];
+        batch->count = BATCH_CAPACITY;
+        for (size_t i = 0; i < BATCH_CAPACITY; i++) {
+            // xorshift64
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            uint64_t offset;
+            if (kind == 0) {
+                offset = position;
+                position = (position + 8) % working_set;
+            }
+            else if (kind == 1) {
+                offset = position;
+                position = (position + BENCH_STRIDE) % working_set;
+            }
+            else if (kind == 2) {
+                offset = (seed >> 16) % working_set & ~(uint64_t) 7;
+            }
+            else if (kind == 3) {
+                double u = (seed >> 11) * 0x1p-53;
+                uint64_t lo = 0;
+                uint64_t hi = block_count - 1;
+                while (lo < hi) {
+                    uint64_t mid = (lo + hi) / 2;
+                    if (cdf[mid] < u) {
+                        lo = mid + 1;
+                    }
+                    else {
+                        hi = mid;
+                    }
+                }
+                // Scatter the ranks, keeping the block within the working set
+                uint64_t block = (lo * 0x9e3779b97f4a7c15 >> 16) % block_count;
+                offset = block * 64 + (seed & 0x38);
+            }
+            else {
+                position = next[position];
+                offset = position * 64;
+            }
+            unsigned roll = (seed >> 56) % 10;
+            batch->op[i] = roll < 7 ? 'L' : roll < 9 ? 'S' : 'M';
+            batch->address[i] = 0x10000000 + offset;
+            batch->size[i] = 8;
+        }
+    }
+    free(cdf);
+    free(next);
+    return 0;
 }
+#endif
 
-uint64_t convert_hex_string(char *string)
+/*
+ * A Csim of csim.h is a Cache and the batch that csim_simulate_batch copies
+ * accesses into, to feed them through simulate_batch like a trace.
+ */
+struct Csim {
+    Cache cache;
+    TraceBatch batch;
+};
+
+Csim *csim_create(const CsimConfig *config)
 {
-    uint64_t res = 0;
-    for (int i = 0; i < strlen(string); i++) {
-        uint64_t d = convert_hex_digit(string[strlen(string)-i-1]);
-        res += d * 1<<(4*i);
+    Csim *sim = calloc(1, sizeof(Csim));
+    if (sim == NULL) {
+        return NULL;
     }
-    return res;
+    Cache *c = &sim->cache;
+    c->set_bit_count = config->set_bits;
+    c->lines_per_set = config->lines_per_set;
+    c->offset_bit_count = config->block_bits;
+    c->policy = config->policy == NULL ? POLICY_LRU : parse_policy(config->policy);
+    c->engine = config->engine == NULL ? ENGINE_AUTO : parse_engine(config->engine);
+    c->dedup = config->dedup;
+    c->sample_period = 1;
+    c->prefetch_distance = PREFETCH_DISTANCE;
+    if ((c->dedup && c->policy != POLICY_LRU) || check_config(c) == 1 || initialize(c) == 1) {
+        free(sim);
+        return NULL;
+    }
+    return sim;
 }
 
-int convert_hex_digit(char digit)
+void csim_simulate_batch(Csim *sim, const csim_addr_t *addrs, const uint8_t *ops, size_t n)
 {
-    if (digit >= '0' && digit <= '9') {
-        return digit-'0';
-    }
-    if (digit >= 'a' && digit <= 'f') {
-        return digit-'a' + 10;
+    TraceBatch *batch = &sim->batch;
+    while (n > 0) {
+        size_t count = n < BATCH_CAPACITY ? n : BATCH_CAPACITY;
+        for (size_t k = 0; k < count; k++) {
+            batch->address[k] = addrs[k];
+            batch->op[k] = ops[k];
+        }
+        batch->count = count;
+        simulate_batch(&sim->cache, batch);
+        addrs += count;
+        ops += count;
+        n -= count;
     }
-    if (digit >= 'A' && digit <= 'F') {
-        return digit-'A' + 10;
+}
+
+void csim_counters(const Csim *sim, CsimCounters *counters)
+{
+    counters->hits = sim->cache.hits;
+    counters->misses = sim->cache.misses;
+    counters->evictions = sim->cache.evictions;
+}
+
+void csim_destroy(Csim *sim)
+{
+    if (sim != NULL) {
+        cleanup(&sim->cache);
+        free(sim);
     }
-    return -1; // BAD
 }
@@ -0,0 +1,69 @@
+/*
+ * The cache simulator of csim.c as a library, for tools that generate their
+ * own accesses instead of reading a trace. Compile csim.c with -DCSIM_LIBRARY
+ * to leave out main and the command line, and link with -pthread -lm. Only
+ * the csim_ names below are exported.
+ *
+ * Each Csim is a separate cache with its own configuration and counters, so a
+ * process may run any number of them. A single Csim is not thread-safe.
+ */
+
+#ifndef CSIM_H
+#define CSIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint64_t csim_addr_t;
+
+/*
+ * The operations of csim_simulate_batch, the letters of a valgrind trace. A
+ * modify is a load and then a store; an instruction fetch is ignored.
+ */
+#define CSIM_LOAD 'L'
+#define CSIM_STORE 'S'
+#define CSIM_MODIFY 'M'
+#define CSIM_INSTRUCTION 'I'
+
+/*
+ * The geometry is that of -s, -E, and -b. policy and engine are the names
+ * that -p and -e take, or NULL for LRU and the automatic engine. dedup is
+ * --dedup, and like it needs LRU.
+ */
+typedef struct CsimConfig {
+    int set_bits;
+    int lines_per_set;
+    int block_bits;
+    const char *policy;
+    const char *engine;
+    int dedup;
+} CsimConfig;
+
+typedef struct CsimCounters {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} CsimCounters;
+
+typedef struct Csim Csim;
+
+/*
+ * Returns a new empty cache, or NULL if config is not one csim accepts (dedup
+ * with a policy other than LRU included) or memory runs out.
+ */
+Csim *csim_create(const CsimConfig *config);
+
+/*
+ * Simulates the n accesses ops[k] to addrs[k], in order. Every access touches
+ * the one block its address falls in.
+ */
+void csim_simulate_batch(Csim *sim, const csim_addr_t *addrs, const uint8_t *ops, size_t n);
+
+/*
+ * Stores the counters of every access simulated so far in counters.
+ */
+void csim_counters(const Csim *sim, CsimCounters *counters);
+
+void csim_destroy(Csim *sim);
+
+#endif